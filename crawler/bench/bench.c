@@ -0,0 +1,1277 @@
+/*  bench.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Microbenchmarks for the crawler's hot paths.
+ *
+ * The crawler source is compiled directly into this file so that its static functions can be
+ * exercised, and the toxcore functions it calls are replaced with stubs so that no network
+ * traffic is generated. Each result is printed to stdout as a single line JSON object. When a
+ * benchmark's sanity check fails, the reason is printed to stderr and the run exits with failure.
+ */
+
+#define _GNU_SOURCE  /* for nftw() */
+
+#define main crawler_main
+#include "../src/main.c"
+#undef main
+
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <tox/tox.h>
+#include "../src/tox_private.h"
+#include "../src/dht_raw.h"
+
+#include "dht_standin.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+/* Upper bound on the amount of work a single benchmark case should do, in node comparisons */
+#define BENCH_WORK_BUDGET 50000000ULL
+
+/* Number of inserts timed individually on each side of a nodes list resize */
+#define BENCH_GROW_WINDOW 32
+
+/* Nodes list size at which the first resize is timed. This was the initial size of the original
+ * pointer array */
+#define BENCH_GROW_START 131072
+
+/* Crawl size and memory budget used to measure spilling nodes to disk */
+#define BENCH_SPILL_NODES  500000
+#define BENCH_SPILL_BUDGET (4 * 1024 * 1024)
+
+/* Size of the synthetic geo database, roughly that of a full ip2asn table */
+#define BENCH_GEO_IPV4_RANGES 400000
+#define BENCH_GEO_IPV6_RANGES 100000
+#define BENCH_GEO_ENRICH_NODES 100000
+
+/* Size of the local stand-in DHT network used by the raw engine benchmarks. Each node uses a file descriptor. */
+#define BENCH_STANDIN_NODES 512
+
+/* Number of getnodes requests sent by the raw request rate benchmark */
+#define BENCH_RAW_REQUESTS 200000
+
+/* Milliseconds without a new response after which the raw request rate benchmark stops waiting */
+#define BENCH_RAW_DRAIN_TIMEOUT 200
+
+/* Number of distinct nodes the shared key cache benchmark sends requests to, about the size of the DHT */
+#define BENCH_RAW_CACHE_NODES 32768
+
+/* Seconds the raw crawl benchmark may take to find every stand-in node */
+#define BENCH_RAW_CRAWL_TIMEOUT 10
+
+/* Unreachable nodes mixed into the stand-in network by the verification benchmark. Half of them share
+ * all but the last key byte with a live node, so they are probed through the same bucket. */
+#define BENCH_VERIFY_DEAD 64
+
+/* Stand-in nodes in the verification bench that answer with an empty node list */
+#define BENCH_VERIFY_EMPTY 32
+
+/* Seconds the verification benchmark may take. Unreachable nodes take VERIFY_MAX_ATTEMPTS timeouts. */
+#define BENCH_VERIFY_TIMEOUT 30
+
+/* Bootstrap candidates that never answer, listed before the same number of live stand-in nodes */
+#define BENCH_BOOTSTRAP_DEAD 4
+#define BENCH_BOOTSTRAP_LIVE 4
+
+/* Milliseconds the bootstrap benchmark waits for its probe */
+#define BENCH_BOOTSTRAP_PROBE_TIMEOUT 500
+
+static uint64_t bench_getnodes_calls;
+
+/*
+ * toxcore stubs.
+ */
+static char bench_tox_instance;
+
+void tox_options_default(struct Tox_Options *options)
+{
+    memset(options, 0, sizeof(struct Tox_Options));
+}
+
+Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
+{
+    if (error) {
+        *error = TOX_ERR_NEW_OK;
+    }
+
+    return (Tox *) &bench_tox_instance;
+}
+
+void tox_kill(Tox *tox)
+{
+}
+
+void tox_iterate(Tox *tox, void *user_data)
+{
+}
+
+uint32_t tox_iteration_interval(const Tox *tox)
+{
+    return 50;
+}
+
+bool tox_bootstrap(Tox *tox, const char *host, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error)
+{
+    if (error) {
+        *error = TOX_ERR_BOOTSTRAP_OK;
+    }
+
+    return true;
+}
+
+void tox_callback_dht_get_nodes_response(Tox *tox, tox_dht_get_nodes_response_cb *callback)
+{
+}
+
+bool tox_dht_get_nodes(const Tox *tox, const uint8_t *public_key, const char *ip, uint16_t port,
+                       const uint8_t *target_public_key, Tox_Err_Dht_Get_Nodes *error)
+{
+    ++bench_getnodes_calls;
+
+    if (error) {
+        *error = TOX_ERR_DHT_GET_NODES_OK;
+    }
+
+    return true;
+}
+
+/*
+ * Benchmark helpers.
+ */
+static uint64_t bench_rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_rand(void)
+{
+    uint64_t x = bench_rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bench_rng_state = x;
+    return x;
+}
+
+static void bench_rand_key(uint8_t *key)
+{
+    for (size_t i = 0; i < NODE_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        const uint64_t r = bench_rand();
+        memcpy(key + i, &r, sizeof(uint64_t));
+    }
+}
+
+static void bench_rand_ip(char *buf, size_t buf_len)
+{
+    const uint64_t r = bench_rand();
+    snprintf(buf, buf_len, "%u.%u.%u.%u", (unsigned) (r & 0xdf) + 1, (unsigned) (r >> 8) & 0xff,
+             (unsigned) (r >> 16) & 0xff, (unsigned) (r >> 24) & 0xff);
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t bench_clamp(uint64_t value, uint64_t min, uint64_t max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+/* The original stderr. stderr itself is redirected to /dev/null while the benchmarks run. */
+static FILE *bench_log;
+
+/* Reports a failed sanity check. The benchmark that calls this must return non-zero. */
+static void bench_fail(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(bench_log, format, args);
+    va_end(args);
+
+    fputc('\n', bench_log);
+    fflush(bench_log);
+}
+
+static void bench_report(const char *name, uint32_t nodes, uint64_t ops, uint64_t elapsed_ns, int64_t max_ns)
+{
+    const double ns_per_op = ops ? (double) elapsed_ns / ops : 0.0;
+    const double ops_per_sec = elapsed_ns ? (double) ops * 1e9 / elapsed_ns : 0.0;
+
+    printf("{\"benchmark\":\"%s\",\"version\":\"%s\",\"nodes\":%u,\"ops\":%llu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f",
+           name, BENCH_VERSION, nodes, (unsigned long long) ops, ns_per_op, ops_per_sec);
+
+    if (max_ns >= 0) {
+        printf(",\"max_ns\":%lld", (long long) max_ns);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* Appends num_nodes random nodes to the crawler's nodes list without going through the getnodes callback. */
+static int bench_fill(Crawler *cwl, uint32_t num_nodes)
+{
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        DHT_Node node;
+        memset(&node, 0, sizeof(node));
+
+        const uint64_t r = bench_rand();
+        bench_rand_key(node.public_key);
+        memcpy(node.ip, &r, 4);
+        node.family = NODE_IPV4;
+        node.port = 33445;
+
+        if (nodes_add(&cwl->nodes, &node) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Delivers a node from a getnodes response the way the toxcore engine does, including parsing its IP string. */
+static void bench_response(Crawler *cwl, const uint8_t *key, const char *ip)
+{
+    DHT_Node node;
+    memset(&node, 0, sizeof(node));
+
+    if (node_ip_parse(&node, ip) != 0) {
+        return;
+    }
+
+    memcpy(node.public_key, key, NODE_PUBLIC_KEY_SIZE);
+    node.port = 33445;
+
+    cb_getnodes_response(cwl, NULL, &node);
+}
+
+static Crawler *bench_crawler_new(uint32_t num_nodes)
+{
+    Crawler *cwl = crawler_new();
+
+    if (cwl == NULL) {
+        return NULL;
+    }
+
+    if (bench_fill(cwl, num_nodes) != 0) {
+        crawler_kill(cwl);
+        return NULL;
+    }
+
+    return cwl;
+}
+
+/*
+ * Benchmarks.
+ */
+static const uint32_t bench_dedup_sizes[] = { 1000, 10000, 100000, 500000, 0 };
+static const uint32_t bench_insert_sizes[] = { 1000, 10000, 30000, 0 };
+static const uint32_t bench_dump_sizes[] = { 1000, 10000, 100000, 0 };
+static const uint32_t bench_send_sizes[] = { 1000, 100000, 500000, 0 };
+
+/* node_crawled() lookups against a list of n nodes; half of the lookups hit and half miss. */
+static int bench_node_crawled(void)
+{
+    for (size_t s = 0; bench_dedup_sizes[s] != 0; ++s) {
+        const uint32_t n = bench_dedup_sizes[s];
+        Crawler *cwl = bench_crawler_new(n);
+
+        if (cwl == NULL) {
+            return -1;
+        }
+
+        const uint64_t ops = bench_clamp(BENCH_WORK_BUDGET / n, 16, 100000);
+        uint8_t miss_key[NODE_PUBLIC_KEY_SIZE];
+        uint64_t found = 0;
+
+        const uint64_t start = bench_now_ns();
+
+        for (uint64_t i = 0; i < ops; ++i) {
+            if (i & 1) {
+                bench_rand_key(miss_key);
+                found += node_crawled(cwl, miss_key);
+            } else {
+                DHT_Node buf;
+                found += node_crawled(cwl, nodes_get(&cwl->nodes, bench_rand() % n, &buf)->public_key);
+            }
+        }
+
+        const uint64_t elapsed = bench_now_ns() - start;
+
+        if (found != (ops + 1) / 2) {
+            bench_fail("node_crawled: unexpected hit count %llu", (unsigned long long) found);
+            crawler_kill(cwl);
+            return -1;
+        }
+
+        bench_report("node_crawled", n, ops, elapsed, -1);
+        crawler_kill(cwl);
+    }
+
+    return 0;
+}
+
+/* Builds a nodes list of n unique nodes from scratch through the getnodes response callback. */
+static int bench_getnodes_response(void)
+{
+    char ip[NODE_IP_STRING_SIZE];
+    uint8_t key[NODE_PUBLIC_KEY_SIZE];
+
+    for (size_t s = 0; bench_insert_sizes[s] != 0; ++s) {
+        const uint32_t n = bench_insert_sizes[s];
+        Crawler *cwl = bench_crawler_new(0);
+
+        if (cwl == NULL) {
+            return -1;
+        }
+
+        const uint64_t start = bench_now_ns();
+
+        for (uint32_t i = 0; i < n; ++i) {
+            bench_rand_key(key);
+            bench_rand_ip(ip, sizeof(ip));
+            bench_response(cwl, key, ip);
+        }
+
+        const uint64_t elapsed = bench_now_ns() - start;
+
+        bench_report("getnodes_response", n, n, elapsed, -1);
+        crawler_kill(cwl);
+    }
+
+    return 0;
+}
+
+/*
+ * Times individual getnodes response callbacks around the points where the nodes list has to grow.
+ * max_ns shows the cost of the resize itself.
+ */
+static int bench_nodes_list_grow(void)
+{
+    char ip[NODE_IP_STRING_SIZE];
+    uint8_t key[NODE_PUBLIC_KEY_SIZE];
+    uint32_t list_size = BENCH_GROW_START;
+
+    for (size_t s = 0; s < 2; ++s, list_size *= 2) {
+        const uint32_t prefill = list_size - BENCH_GROW_WINDOW;
+        Crawler *cwl = bench_crawler_new(prefill);
+
+        if (cwl == NULL) {
+            return -1;
+        }
+
+        uint64_t elapsed = 0;
+        int64_t max_ns = 0;
+
+        for (uint32_t i = 0; i < BENCH_GROW_WINDOW * 2; ++i) {
+            bench_rand_key(key);
+            bench_rand_ip(ip, sizeof(ip));
+
+            const uint64_t start = bench_now_ns();
+            bench_response(cwl, key, ip);
+            const uint64_t t = bench_now_ns() - start;
+
+            elapsed += t;
+
+            if ((int64_t) t > max_ns) {
+                max_ns = t;
+            }
+        }
+
+        bench_report("nodes_list_grow", prefill, BENCH_GROW_WINDOW * 2, elapsed, max_ns);
+        crawler_kill(cwl);
+    }
+
+    return 0;
+}
+
+static int bench_rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+typedef struct Bench_Dir {
+    char base[PATH_MAX / 2];
+    char cwd[PATH_MAX];
+} Bench_Dir;
+
+/*
+ * Creates a temporary directory and changes into a subdirectory of it, so that log files written
+ * relative to the working directory end up inside it.
+ */
+static int bench_enter_temp_dir(Bench_Dir *dir)
+{
+    snprintf(dir->base, sizeof(dir->base), "/tmp/toxcrawler-bench-XXXXXX");
+
+    if (mkdtemp(dir->base) == NULL) {
+        return -1;
+    }
+
+    char run_dir[PATH_MAX];
+    snprintf(run_dir, sizeof(run_dir), "%s/run", dir->base);
+
+    if (getcwd(dir->cwd, sizeof(dir->cwd)) == NULL || mkdir(run_dir, 0700) != 0 || chdir(run_dir) != 0) {
+        nftw(dir->base, bench_rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Changes back to the original working directory and removes the temporary directory. */
+static int bench_leave_temp_dir(Bench_Dir *dir)
+{
+    const int ret = chdir(dir->cwd);
+
+    nftw(dir->base, bench_rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    return ret == 0 ? 0 : -1;
+}
+
+/* Writes the log file for a crawler holding n nodes. */
+static int bench_dump_log(void)
+{
+    Bench_Dir dir;
+
+    if (bench_enter_temp_dir(&dir) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+
+    for (size_t s = 0; bench_dump_sizes[s] != 0; ++s) {
+        const uint32_t n = bench_dump_sizes[s];
+        Crawler *cwl = bench_crawler_new(n);
+
+        if (cwl == NULL) {
+            ret = -1;
+            break;
+        }
+
+        const uint64_t ops = bench_clamp(BENCH_WORK_BUDGET / 50 / n, 3, 1000);
+        const uint64_t start = bench_now_ns();
+
+        for (uint64_t i = 0; i < ops; ++i) {
+            if (crawler_dump_log(cwl) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+
+        const uint64_t elapsed = bench_now_ns() - start;
+
+        crawler_kill(cwl);
+
+        if (ret != 0) {
+            break;
+        }
+
+        bench_report("crawler_dump_log", n, ops, elapsed, -1);
+    }
+
+    if (bench_leave_temp_dir(&dir) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Writes a synthetic prefix database with a realistic number of IPv4 and IPv6 ranges. */
+static int bench_write_geo_source(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    static const char *countries[] = { "US", "DE", "FR", "RU", "CN", "NL", "GB", "JP", "None" };
+    uint64_t addr = 1 << 24;
+
+    for (uint32_t i = 0; i < BENCH_GEO_IPV4_RANGES && addr < UINT32_MAX; ++i) {
+        const uint64_t len = 1 + bench_rand() % (1 << (8 + bench_rand() % 6));
+        const uint64_t end = MIN(addr + len - 1, UINT32_MAX);
+
+        fprintf(fp, "%u.%u.%u.%u\t%u.%u.%u.%u\t%u\t%s\tbench\n",
+                (unsigned) (addr >> 24) & 0xff, (unsigned) (addr >> 16) & 0xff, (unsigned) (addr >> 8) & 0xff,
+                (unsigned) addr & 0xff, (unsigned) (end >> 24) & 0xff, (unsigned) (end >> 16) & 0xff,
+                (unsigned) (end >> 8) & 0xff, (unsigned) end & 0xff, (unsigned) (bench_rand() % 60000),
+                countries[bench_rand() % (sizeof(countries) / sizeof(countries[0]))]);
+
+        addr = end + 1 + bench_rand() % 4096;
+    }
+
+    for (uint32_t i = 0; i < BENCH_GEO_IPV6_RANGES; ++i) {
+        const unsigned prefix = 0x2000 + i / 16;
+        const unsigned sub = (i % 16) << 12;
+
+        fprintf(fp, "%x:%x::\t%x:%x:ffff:ffff:ffff:ffff:ffff:ffff\t%u\t%s\tbench\n", prefix, sub, prefix,
+                sub | 0xfff, (unsigned) (bench_rand() % 60000), countries[bench_rand() % 8]);
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Compiles a synthetic prefix database and measures lookups and log enrichment against it. */
+static int bench_geo(void)
+{
+    Bench_Dir dir;
+
+    if (bench_enter_temp_dir(&dir) != 0) {
+        return -1;
+    }
+
+    Geo_DB *db = NULL;
+    Crawler *cwl = NULL;
+    int ret = -1;
+
+    if (bench_write_geo_source("geo.tsv") != 0) {
+        goto out;
+    }
+
+    uint64_t start = bench_now_ns();
+
+    if (geo_db_compile("geo.tsv", "geo.db") != 0 || (db = geo_db_load("geo.db")) == NULL) {
+        goto out;
+    }
+
+    bench_report("geo_db_compile", BENCH_GEO_IPV4_RANGES + BENCH_GEO_IPV6_RANGES, 1, bench_now_ns() - start, -1);
+
+    const uint64_t ops = 10000000;
+    uint64_t found = 0;
+
+    start = bench_now_ns();
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        found += geo_lookup_ipv4(db, (uint32_t) bench_rand()) != 0;
+    }
+
+    bench_report("geo_lookup_ipv4", 0, ops, bench_now_ns() - start, -1);
+
+    uint8_t addr6[16];
+    start = bench_now_ns();
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        const uint64_t r = bench_rand();
+        memcpy(addr6, &r, sizeof(r));
+        memcpy(addr6 + 8, &r, sizeof(r));
+        addr6[0] = 0x20;
+        found += geo_lookup_ipv6(db, addr6) != 0;
+    }
+
+    bench_report("geo_lookup_ipv6", 0, ops, bench_now_ns() - start, -1);
+
+    if (found == 0) {
+        bench_fail("geo: no lookups matched");
+        goto out;
+    }
+
+    cwl = bench_crawler_new(BENCH_GEO_ENRICH_NODES);
+
+    if (cwl == NULL) {
+        goto out;
+    }
+
+    start = bench_now_ns();
+
+    if (geo_enrich(db, "enrich", crawler_node_ip, cwl, cwl->nodes.num_nodes) != 0) {
+        goto out;
+    }
+
+    bench_report("geo_enrich", cwl->nodes.num_nodes, cwl->nodes.num_nodes, bench_now_ns() - start, -1);
+
+    ret = 0;
+
+out:
+    if (cwl != NULL) {
+        crawler_kill(cwl);
+    }
+
+    geo_db_free(db);
+
+    if (bench_leave_temp_dir(&dir) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Checks that the i-th address in the log file at path is ips[i] for every node. Returns -1 if not. */
+static int bench_check_log(const char *path, char (*ips)[NODE_IP_STRING_SIZE], uint32_t num_ips)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char ip[NODE_IP_STRING_SIZE];
+    uint32_t i = 0;
+
+    while (i < num_ips && fscanf(fp, "%47s", ip) == 1 && strcmp(ip, ips[i]) == 0) {
+        ++i;
+    }
+
+    const bool at_end = fscanf(fp, "%47s", ip) == EOF;
+    fclose(fp);
+
+    return i == num_ips && at_end ? 0 : -1;
+}
+
+/*
+ * Builds a large nodes list through the getnodes callback with a memory budget that forces most of it
+ * to be spilled to disk, then writes its log file and checks that every node comes back intact. Also
+ * times getnodes requests on the spilled list.
+ */
+static int bench_nodes_spill(void)
+{
+    Bench_Dir dir;
+
+    if (bench_enter_temp_dir(&dir) != 0) {
+        return -1;
+    }
+
+    nodes_set_memory_budget(BENCH_SPILL_BUDGET, ".");
+
+    char ip[NODE_IP_STRING_SIZE];
+    uint8_t key[NODE_PUBLIC_KEY_SIZE];
+    Crawler *cwl = bench_crawler_new(0);
+    char (*ips)[NODE_IP_STRING_SIZE] = malloc(BENCH_SPILL_NODES * sizeof(*ips));
+    int ret = -1;
+
+    if (cwl == NULL || ips == NULL) {
+        goto out;
+    }
+
+    const uint64_t seed = bench_rng_state;
+    uint64_t start = bench_now_ns();
+
+    for (uint32_t i = 0; i < BENCH_SPILL_NODES; ++i) {
+        bench_rand_key(key);
+        bench_rand_ip(ip, sizeof(ip));
+        bench_response(cwl, key, ip);
+        nodes_set_cold_limit(&cwl->nodes, cwl->nodes.num_nodes);
+    }
+
+    bench_report("nodes_spill_insert", cwl->nodes.num_nodes, BENCH_SPILL_NODES, bench_now_ns() - start, -1);
+
+    if (cwl->nodes.num_spilled == 0 || cwl->nodes.num_nodes != BENCH_SPILL_NODES) {
+        bench_fail("nodes_spill: %u nodes stored, %u chunks spilled", cwl->nodes.num_nodes, cwl->nodes.num_spilled);
+        goto out;
+    }
+
+    /* Regenerate the nodes and compare them to what the store gives back */
+    bench_rng_state = seed;
+
+    for (uint32_t i = 0; i < BENCH_SPILL_NODES; ++i) {
+        bench_rand_key(key);
+        bench_rand_ip(ips[i], sizeof(ips[i]));
+
+        DHT_Node buf;
+        const DHT_Node *node = nodes_get(&cwl->nodes, i, &buf);
+
+        if (node == NULL || memcmp(node->public_key, key, NODE_PUBLIC_KEY_SIZE) != 0
+                || strcmp(node_ip_string(node, ip, sizeof(ip)), ips[i]) != 0) {
+            bench_fail("nodes_spill: node %u did not come back intact", i);
+            goto out;
+        }
+    }
+
+    start = bench_now_ns();
+
+    if (crawler_dump_log(cwl) != 0) {
+        goto out;
+    }
+
+    bench_report("nodes_spill_dump", cwl->nodes.num_nodes, 1, bench_now_ns() - start, -1);
+
+    if (crawler_write_log(cwl, "readback" LOG_FILE_EXT, LOG_ALL) != 0
+            || bench_check_log("readback" LOG_FILE_EXT, ips, BENCH_SPILL_NODES) != 0) {
+        bench_fail("nodes_spill: log file does not match the nodes list");
+        goto out;
+    }
+
+    const uint64_t ops = 10000;
+    bench_getnodes_calls = 0;
+    start = bench_now_ns();
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        cwl->last_getnodes_request = 0;
+        send_node_requests(cwl);
+    }
+
+    bench_report("nodes_spill_send", cwl->nodes.num_nodes, ops, bench_now_ns() - start, -1);
+
+    ret = 0;
+
+out:
+    if (cwl != NULL) {
+        crawler_kill(cwl);
+    }
+
+    free(ips);
+
+    nodes_set_memory_budget(0, ".");
+
+    if (bench_leave_temp_dir(&dir) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int bench_hex_string_to_bin(void)
+{
+    const char *key = bs_nodes[0].key;
+    const size_t key_len = strlen(key);
+    char bin_key[NODE_PUBLIC_KEY_SIZE];
+    const uint64_t ops = 1000000;
+
+    const uint64_t start = bench_now_ns();
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        if (hex_string_to_bin(key, key_len, bin_key, sizeof(bin_key)) != 0) {
+            return -1;
+        }
+    }
+
+    const uint64_t elapsed = bench_now_ns() - start;
+
+    bench_report("hex_string_to_bin", 0, ops, elapsed, -1);
+
+    return 0;
+}
+
+/* One op is a single send_node_requests() call, which queries up to MAX_GETNODES_REQUESTS nodes. */
+static int bench_send_node_requests(void)
+{
+    for (size_t s = 0; bench_send_sizes[s] != 0; ++s) {
+        const uint32_t n = bench_send_sizes[s];
+        Crawler *cwl = bench_crawler_new(n);
+
+        if (cwl == NULL) {
+            return -1;
+        }
+
+        const uint64_t ops = 100000;
+        bench_getnodes_calls = 0;
+
+        const uint64_t start = bench_now_ns();
+
+        for (uint64_t i = 0; i < ops; ++i) {
+            cwl->last_getnodes_request = 0;
+            send_node_requests(cwl);
+        }
+
+        const uint64_t elapsed = bench_now_ns() - start;
+
+        if (bench_getnodes_calls == 0) {
+            bench_fail("send_node_requests: no requests were sent");
+            crawler_kill(cwl);
+            return -1;
+        }
+
+        bench_report("send_node_requests", n, ops, elapsed, -1);
+        crawler_kill(cwl);
+    }
+
+    return 0;
+}
+
+static void bench_ignore_response(void *user_data, const uint8_t *responder_key, const DHT_Node *node)
+{
+}
+
+/*
+ * Sends getnodes requests through a raw client to random stand-in nodes as fast as it will take them.
+ * raw_engine_requests is the send rate; raw_engine_responses is the rate at which answers came back
+ * over the whole run, which is bounded by the single threaded stand-in network.
+ */
+static int bench_raw_requests(void)
+{
+    DHT_Standin *net = dht_standin_new(BENCH_STANDIN_NODES);
+    DHT_Raw *dht = dht_raw_new(2, bench_ignore_response);
+    int ret = -1;
+
+    if (net == NULL || dht == NULL) {
+        goto out;
+    }
+
+    DHT_Node nodes[BENCH_STANDIN_NODES];
+
+    for (uint32_t i = 0; i < BENCH_STANDIN_NODES; ++i) {
+        dht_standin_node(net, i, &nodes[i]);
+    }
+
+    uint8_t target[NODE_PUBLIC_KEY_SIZE];
+    const uint64_t start = bench_now_ns();
+    const uint64_t cpu_start = thread_cpu_time();
+
+    for (uint32_t i = 0; i < BENCH_RAW_REQUESTS; ++i) {
+        bench_rand_key(target);
+
+        if (!dht_raw_get_nodes(dht, &nodes[bench_rand() % BENCH_STANDIN_NODES], target)) {
+            goto out;
+        }
+
+        if ((i & 255) == 255) {
+            dht_raw_iterate(dht, NULL);
+        }
+    }
+
+    dht_raw_iterate(dht, NULL);
+
+    const uint64_t send_elapsed = bench_now_ns() - start;
+    DHT_Raw_Stats stats;
+    uint64_t last_response = bench_now_ns();
+    uint64_t responses = 0;
+
+    while (bench_now_ns() - last_response < BENCH_RAW_DRAIN_TIMEOUT * 1000000ULL) {
+        dht_raw_iterate(dht, NULL);
+        dht_raw_get_stats(dht, &stats);
+
+        if (stats.responses != responses) {
+            responses = stats.responses;
+            last_response = bench_now_ns();
+        }
+
+        if (responses == BENCH_RAW_REQUESTS) {
+            break;
+        }
+
+        usleep(1000);
+    }
+
+    const uint64_t cpu_elapsed = thread_cpu_time() - cpu_start;
+
+    bench_report("raw_engine_requests", BENCH_STANDIN_NODES, stats.requests_sent, send_elapsed, -1);
+    bench_report("raw_engine_responses", BENCH_STANDIN_NODES, responses, last_response - start, -1);
+
+    /* Client CPU time per request, including handling its response; see bench_engines for toxcore */
+    bench_report("raw_engine_cpu", BENCH_STANDIN_NODES, stats.requests_sent, cpu_elapsed, -1);
+
+    if (stats.bad_packets != 0) {
+        bench_fail("raw_engine: %llu bad packets", (unsigned long long) stats.bad_packets);
+        goto out;
+    }
+
+    if (responses == 0 || responses != dht_standin_requests(net)
+            || stats.requests_sent + stats.requests_dropped != BENCH_RAW_REQUESTS) {
+        bench_fail("raw_engine: %llu responses for %llu answered requests, %llu sent and %llu dropped",
+                   (unsigned long long) responses, (unsigned long long) dht_standin_requests(net),
+                   (unsigned long long) stats.requests_sent, (unsigned long long) stats.requests_dropped);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    dht_raw_kill(dht);
+    dht_standin_kill(net);
+
+    return ret;
+}
+
+/*
+ * Sends requests to a set of nodes larger than the initial shared key cache, as a crawl of the real
+ * DHT does. The first passes compute the shared keys and grow the cache; the last pass is timed and
+ * should find them all in it. Requests go to a port nobody listens on, so no responses are handled.
+ */
+static int bench_raw_key_cache(void)
+{
+    DHT_Raw *dht = dht_raw_new(1, bench_ignore_response);
+    DHT_Node *nodes = calloc(BENCH_RAW_CACHE_NODES, sizeof(DHT_Node));
+    int ret = -1;
+
+    if (dht == NULL || nodes == NULL) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < BENCH_RAW_CACHE_NODES; ++i) {
+        node_ip_parse(&nodes[i], "127.0.0.1");
+        nodes[i].port = 9;
+        bench_rand_key(nodes[i].public_key);
+    }
+
+    uint64_t start = 0;
+
+    for (uint32_t pass = 0; pass < 3; ++pass) {
+        start = bench_now_ns();
+
+        for (uint32_t i = 0; i < BENCH_RAW_CACHE_NODES; ++i) {
+            if (!dht_raw_get_nodes(dht, &nodes[i], nodes[i].public_key)) {
+                goto out;
+            }
+        }
+
+        dht_raw_iterate(dht, NULL);
+    }
+
+    bench_report("raw_engine_key_cache", BENCH_RAW_CACHE_NODES, BENCH_RAW_CACHE_NODES, bench_now_ns() - start, -1);
+
+    ret = 0;
+
+out:
+    dht_raw_kill(dht);
+    free(nodes);
+
+    return ret;
+}
+
+/*
+ * Crawls the stand-in network with a raw engine crawler, starting from a single bootstrap node, until
+ * every node has been found. One op is one node found, including the crawler's iteration interval.
+ */
+static int bench_raw_crawl(void)
+{
+    DHT_Standin *net = dht_standin_new(BENCH_STANDIN_NODES);
+    Crawler *cwl = crawler_create(ENGINE_RAW);
+    int ret = -1;
+
+    if (net == NULL || cwl == NULL) {
+        goto out;
+    }
+
+    DHT_Node bs_node;
+    dht_standin_node(net, 0, &bs_node);
+
+    if (engine_bootstrap(cwl->engine, "127.0.0.1", bs_node.port, bs_node.public_key) != 0) {
+        goto out;
+    }
+
+    const uint64_t start = bench_now_ns();
+    const uint64_t deadline = start + BENCH_RAW_CRAWL_TIMEOUT * 1000000000ULL;
+
+    while (cwl->nodes.num_nodes < BENCH_STANDIN_NODES && bench_now_ns() < deadline) {
+        engine_iterate(cwl->engine, cwl);
+        send_node_requests(cwl);
+        usleep(engine_iteration_interval(cwl->engine) * 1000);
+    }
+
+    if (cwl->nodes.num_nodes < BENCH_STANDIN_NODES) {
+        bench_fail("raw_engine_crawl: found %u of %u nodes", cwl->nodes.num_nodes, BENCH_STANDIN_NODES);
+        goto out;
+    }
+
+    bench_report("raw_engine_crawl", BENCH_STANDIN_NODES, cwl->nodes.num_nodes, bench_now_ns() - start, -1);
+
+    ret = 0;
+
+out:
+    if (cwl != NULL) {
+        crawler_kill(cwl);
+    }
+
+    dht_standin_kill(net);
+
+    return ret;
+}
+
+/*
+ * Verifies a nodes list made of every stand-in node and BENCH_VERIFY_DEAD unreachable nodes. The last
+ * BENCH_VERIFY_EMPTY stand-in nodes answer with an empty node list. Checks that exactly the stand-in
+ * nodes are verified. One op is one node verified or declared unreachable.
+ */
+static int bench_verify_nodes(void)
+{
+    DHT_Standin *net = dht_standin_new(BENCH_STANDIN_NODES);
+
+    settings.verify_nodes = true;
+    Crawler *cwl = crawler_create(ENGINE_RAW);
+    settings.verify_nodes = false;
+
+    int ret = -1;
+
+    if (net == NULL || cwl == NULL) {
+        goto out;
+    }
+
+    for (uint32_t i = BENCH_STANDIN_NODES - BENCH_VERIFY_EMPTY; i < BENCH_STANDIN_NODES; ++i) {
+        dht_standin_set_empty(net, i, true);
+    }
+
+    /* Nothing listens on these privileged ports, so probes to them are never answered */
+    for (uint32_t i = 0; i < BENCH_VERIFY_DEAD; ++i) {
+        DHT_Node node;
+        memset(&node, 0, sizeof(node));
+        node_ip_parse(&node, "127.0.0.1");
+        node.port = i + 1;
+
+        if (i & 1) {
+            bench_rand_key(node.public_key);
+        } else {
+            DHT_Node live;
+            dht_standin_node(net, i, &live);
+            memcpy(node.public_key, live.public_key, NODE_PUBLIC_KEY_SIZE);
+            node.public_key[NODE_PUBLIC_KEY_SIZE - 1] ^= 0xff;
+        }
+
+        cb_getnodes_response(cwl, NULL, &node);
+    }
+
+    for (uint32_t i = 0; i < BENCH_STANDIN_NODES; ++i) {
+        DHT_Node node;
+        dht_standin_node(net, i, &node);
+        cb_getnodes_response(cwl, NULL, &node);
+    }
+
+    const uint32_t num_nodes = cwl->nodes.num_nodes;
+    const uint64_t start = bench_now_ns();
+    const uint64_t deadline = start + BENCH_VERIFY_TIMEOUT * 1000000000ULL;
+
+    while (!verification_done(cwl) && bench_now_ns() < deadline) {
+        engine_iterate(cwl->verify_engine, cwl);
+        send_verify_requests(cwl);
+        usleep(engine_iteration_interval(cwl->verify_engine) * 1000);
+    }
+
+    const uint64_t elapsed = bench_now_ns() - start;
+    uint32_t num_ok = 0;
+    uint32_t num_wrong = 0;
+
+    for (uint32_t i = 0; i < cwl->nodes.num_nodes; ++i) {
+        DHT_Node buf;
+        const DHT_Node *node = nodes_get(&cwl->nodes, i, &buf);
+        const bool live = i >= BENCH_VERIFY_DEAD;
+
+        num_ok += node->verify_state == VERIFY_OK;
+        num_wrong += node->verify_state != (live ? VERIFY_OK : VERIFY_FAILED);
+    }
+
+    if (cwl->nodes.num_nodes != num_nodes || num_wrong != 0 || num_ok != cwl->num_verified) {
+        bench_fail("verify_nodes: %u of %u nodes in the wrong state, %u verified, %u counted", num_wrong,
+                   cwl->nodes.num_nodes, num_ok, cwl->num_verified);
+        goto out;
+    }
+
+    bench_report("verify_nodes", num_nodes, num_nodes, elapsed, -1);
+
+    ret = 0;
+
+out:
+    if (cwl != NULL) {
+        crawler_kill(cwl);
+    }
+
+    dht_standin_kill(net);
+
+    return ret;
+}
+
+/*
+ * Runs a raw crawler seeded from list until it gets its first response, falling back to the next
+ * candidates like the crawler thread does. Returns the time it took, or 0 on failure or timeout.
+ */
+static uint64_t bench_first_response(const Bootstrap_List *list)
+{
+    Crawler *cwl = crawler_create(ENGINE_RAW);
+
+    if (cwl == NULL) {
+        return 0;
+    }
+
+    if (crawler_seed(cwl, list) != 0) {
+        crawler_kill(cwl);
+        return 0;
+    }
+
+    const uint64_t start = bench_now_ns();
+    const uint64_t deadline = start + BENCH_RAW_CRAWL_TIMEOUT * 1000000000ULL;
+
+    while (cwl->nodes.num_nodes == 0 && bench_now_ns() < deadline) {
+        engine_iterate(cwl->engine, cwl);
+        send_node_requests(cwl);
+
+        if (cwl->nodes.num_nodes == 0 && timed_out(cwl->last_bootstrap, BOOTSTRAP_FALLBACK_TIMEOUT)) {
+            bootstrap_crawler(cwl);
+        }
+
+        usleep(engine_iteration_interval(cwl->engine) * 1000);
+    }
+
+    const uint64_t elapsed = cwl->nodes.num_nodes > 0 ? bench_now_ns() - start : 0;
+
+    crawler_kill(cwl);
+
+    return elapsed;
+}
+
+/*
+ * Time to first response of a new crawler when its first bootstrap candidates are dead, in list order
+ * and after probing and ranking the candidates. The probe itself is reported separately.
+ */
+static int bench_bootstrap_first_response(void)
+{
+    DHT_Standin *net = dht_standin_new(BENCH_STANDIN_NODES);
+    Bootstrap_List *list = calloc(1, sizeof(Bootstrap_List));
+    int ret = -1;
+
+    if (net == NULL || list == NULL) {
+        goto out;
+    }
+
+    /* Nothing listens on these privileged ports, so requests to them are never answered */
+    for (uint16_t i = 0; i < BENCH_BOOTSTRAP_DEAD; ++i) {
+        DHT_Node *node = &list->nodes[list->num_nodes++].node;
+        node_ip_parse(node, "127.0.0.1");
+        node->port = i + 1;
+        bench_rand_key(node->public_key);
+    }
+
+    for (uint16_t i = 0; i < BENCH_BOOTSTRAP_LIVE; ++i) {
+        dht_standin_node(net, i, &list->nodes[list->num_nodes++].node);
+    }
+
+    const uint64_t unranked = bench_first_response(list);
+
+    const uint64_t probe_start = bench_now_ns();
+    const int answered = bootstrap_probe(list, BENCH_BOOTSTRAP_PROBE_TIMEOUT);
+    const uint64_t probe_time = bench_now_ns() - probe_start;
+
+    if (unranked == 0 || answered != BENCH_BOOTSTRAP_LIVE) {
+        goto out;
+    }
+
+    bootstrap_rank(list);
+
+    const uint64_t ranked = bench_first_response(list);
+
+    if (ranked == 0) {
+        goto out;
+    }
+
+    bench_report("bootstrap_first_response_unranked", list->num_nodes, 1, unranked, -1);
+    bench_report("bootstrap_probe", list->num_nodes, list->num_nodes, probe_time, -1);
+    bench_report("bootstrap_first_response_ranked", list->num_nodes, 1, ranked, -1);
+
+    ret = 0;
+
+out:
+    free(list);
+    dht_standin_kill(net);
+
+    return ret;
+}
+
+/*
+ * autoscale_note_node() runs for every new node. Two crawlers find the same random nodes, so half of
+ * the calls take the overlap path.
+ */
+static int bench_autoscale_note_node(void)
+{
+    Autoscale_Slot *older = autoscale_register();
+    Autoscale_Slot *newer = autoscale_register();
+
+    if (older == NULL || newer == NULL) {
+        return -1;
+    }
+
+    const uint64_t ops = 1000000;
+    const uint64_t seed = bench_rng_state;
+    uint8_t key[NODE_PUBLIC_KEY_SIZE];
+
+    const uint64_t start = bench_now_ns();
+
+    for (size_t pass = 0; pass < 2; ++pass) {
+        bench_rng_state = seed;
+
+        for (uint64_t i = 0; i < ops / 2; ++i) {
+            bench_rand_key(key);
+            autoscale_note_node(pass == 0 ? older : newer, key);
+        }
+    }
+
+    const uint64_t elapsed = bench_now_ns() - start;
+
+    bench_report("autoscale_note_node", 0, ops, elapsed, -1);
+
+    autoscale_release(older);
+    autoscale_release(newer);
+
+    return 0;
+}
+
+static const struct Bench {
+    const char *name;
+    int (*func)(void);
+} benchmarks[] = {
+    { "hex_string_to_bin",  bench_hex_string_to_bin  },
+    { "node_crawled",       bench_node_crawled       },
+    { "getnodes_response",  bench_getnodes_response  },
+    { "nodes_list_grow",    bench_nodes_list_grow    },
+    { "crawler_dump_log",   bench_dump_log           },
+    { "send_node_requests", bench_send_node_requests },
+    { "nodes_spill",        bench_nodes_spill        },
+    { "geo",                bench_geo                },
+    { "raw_engine_requests", bench_raw_requests      },
+    { "raw_engine_key_cache", bench_raw_key_cache    },
+    { "raw_engine_crawl",   bench_raw_crawl          },
+    { "bootstrap_first_response", bench_bootstrap_first_response },
+    { "verify_nodes",       bench_verify_nodes       },
+    { "autoscale_note_node", bench_autoscale_note_node },
+    { NULL, NULL },
+};
+
+/*
+ * Usage: bench_crawler [filter]
+ *
+ * Runs every benchmark whose name contains filter, or all of them if no filter is given.
+ */
+int main(int argc, char **argv)
+{
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    /* The crawler logs every node it finds to stderr, which would drown out the results */
+    const int log_fd = dup(STDERR_FILENO);
+    bench_log = log_fd != -1 ? fdopen(log_fd, "w") : NULL;
+
+    if (bench_log == NULL || freopen("/dev/null", "w", stderr) == NULL) {
+        fprintf(stdout, "Failed to redirect stderr\n");
+        return EXIT_FAILURE;
+    }
+
+    if (pthread_mutex_init(&threads.lock, NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (size_t i = 0; benchmarks[i].name != NULL; ++i) {
+        if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL) {
+            continue;
+        }
+
+        if (benchmarks[i].func() != 0) {
+            fprintf(stdout, "{\"benchmark\":\"%s\",\"version\":\"%s\",\"error\":true}\n", benchmarks[i].name,
+                    BENCH_VERSION);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,179 @@
+/*  bench_engines.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Compares the CPU cost per getnodes request of the toxcore and raw engines.
+ *
+ * Unlike bench_crawler, this links against the real toxcore. Both engines send the same requests to a
+ * local stand-in DHT network, in batches the size of one crawler iteration, and are iterated the same
+ * number of times. The CPU time of the calling thread, which is where both engines do all of their
+ * work, is divided by the number of requests sent. The iteration interval plays no part, so this
+ * shows the per-core cost of a request on its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/engine.h"
+#include "dht_standin.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_ENGINE_NODES 512
+
+/* Requests per iteration, the most a crawler sends in one iteration of send_node_requests() */
+#define BENCH_ENGINE_BATCH 180
+
+#define BENCH_ENGINE_ITERATIONS 200
+
+/* Milliseconds without a new response after which we stop waiting for more */
+#define BENCH_ENGINE_DRAIN_TIMEOUT 500
+
+static uint64_t bench_rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_rand(void)
+{
+    uint64_t x = bench_rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bench_rng_state = x;
+    return x;
+}
+
+static uint64_t bench_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void bench_count_node(void *user_data, const uint8_t *responder_key, const DHT_Node *node)
+{
+    if (node != NULL) {
+        ++*(uint64_t *) user_data;
+    }
+}
+
+/*
+ * Runs the workload through an engine of the given type.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the engine cannot be created.
+ * Returns -2 if no responses were received.
+ */
+static int bench_engine(const DHT_Standin *net, Engine_Type type, const char *name)
+{
+    Engine *engine = engine_new(type, bench_count_node);
+
+    if (engine == NULL) {
+        return -1;
+    }
+
+    uint64_t nodes_received = 0;
+    uint64_t requests = 0;
+    uint8_t target[NODE_PUBLIC_KEY_SIZE];
+
+    const uint64_t cpu_start = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    for (uint32_t i = 0; i < BENCH_ENGINE_ITERATIONS; ++i) {
+        for (uint32_t j = 0; j < BENCH_ENGINE_BATCH; ++j) {
+            DHT_Node node;
+            dht_standin_node(net, bench_rand() % BENCH_ENGINE_NODES, &node);
+
+            for (size_t k = 0; k < sizeof(target); k += sizeof(uint64_t)) {
+                const uint64_t r = bench_rand();
+                memcpy(target + k, &r, sizeof(r));
+            }
+
+            requests += engine_get_nodes(engine, &node, target);
+        }
+
+        engine_iterate(engine, &nodes_received);
+    }
+
+    uint64_t last_change = bench_clock_ns(CLOCK_MONOTONIC);
+    uint64_t last_count = nodes_received;
+
+    while (bench_clock_ns(CLOCK_MONOTONIC) - last_change < BENCH_ENGINE_DRAIN_TIMEOUT * 1000000ULL) {
+        usleep(1000);
+        engine_iterate(engine, &nodes_received);
+
+        if (nodes_received != last_count) {
+            last_count = nodes_received;
+            last_change = bench_clock_ns(CLOCK_MONOTONIC);
+        }
+    }
+
+    const uint64_t cpu_ns = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    engine_kill(engine);
+
+    if (nodes_received == 0) {
+        fprintf(stderr, "%s: no responses for %llu requests\n", name, (unsigned long long) requests);
+        return -2;
+    }
+
+    printf("{\"benchmark\":\"%s\",\"version\":\"%s\",\"nodes\":%u,\"ops\":%llu,\"ns_per_op\":%.1f,"
+           "\"ops_per_sec\":%.0f,\"nodes_received\":%llu}\n",
+           name, BENCH_VERSION, BENCH_ENGINE_NODES, (unsigned long long) requests,
+           requests ? (double) cpu_ns / requests : 0.0, cpu_ns ? (double) requests * 1e9 / cpu_ns : 0.0,
+           (unsigned long long) nodes_received);
+    fflush(stdout);
+
+    return 0;
+}
+
+/*
+ * Usage: bench_engines
+ *
+ * Prints one JSON line per engine where ns_per_op is the CPU time per request. Exits with failure
+ * if an engine gets no responses, which also happens when toxcore is stubbed out.
+ */
+int main(void)
+{
+    DHT_Standin *net = dht_standin_new(BENCH_ENGINE_NODES);
+
+    if (net == NULL) {
+        fprintf(stderr, "Failed to start the stand-in network\n");
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    if (bench_engine(net, ENGINE_TOX, "engine_tox_cpu") != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (bench_engine(net, ENGINE_RAW, "engine_raw_cpu") != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    dht_standin_kill(net);
+
+    return ret;
+}
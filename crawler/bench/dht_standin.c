@@ -0,0 +1,328 @@
+/*  dht_standin.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#define _GNU_SOURCE  /* for recvmmsg() */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <sodium.h>
+
+#include "dht_standin.h"
+#include "../src/dht_raw.h"
+
+#define STANDIN_BATCH_SIZE 64
+#define STANDIN_EPOLL_EVENTS 64
+
+/* Milliseconds between checks of the stop flag */
+#define STANDIN_POLL_TIMEOUT 50
+
+#define STANDIN_REQUEST_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES \
+                              + DHT_RAW_PING_ID_SIZE + crypto_box_MACBYTES)
+
+#define STANDIN_PACKED_NODE_SIZE (1 + 4 + sizeof(uint16_t) + crypto_box_PUBLICKEYBYTES)
+#define STANDIN_RESPONSE_PLAIN_SIZE (1 + DHT_RAW_MAX_SENT_NODES * STANDIN_PACKED_NODE_SIZE + DHT_RAW_PING_ID_SIZE)
+#define STANDIN_RESPONSE_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + STANDIN_RESPONSE_PLAIN_SIZE \
+                               + crypto_box_MACBYTES)
+
+typedef struct Standin_Node {
+    int      fd;
+    uint16_t port;
+    uint8_t  public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t  secret_key[crypto_box_SECRETKEYBYTES];
+
+    /* Shared key with the last client we heard from; clients are few, so one entry is enough */
+    uint8_t  client_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t  shared_key[crypto_box_BEFORENMBYTES];
+    bool     have_shared_key;
+
+    bool     empty;   /* answer with no nodes */
+} Standin_Node;
+
+struct DHT_Standin {
+    Standin_Node *nodes;
+    uint32_t     num_nodes;
+    int          epoll_fd;
+
+    uint8_t      nonce[crypto_box_NONCEBYTES];
+    uint64_t     rng_state;
+    uint64_t     num_requests;
+
+    bool         stop;
+    pthread_t    tid;
+};
+
+static uint32_t standin_rand(DHT_Standin *net)
+{
+    uint64_t x = net->rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    net->rng_state = x;
+    return (uint32_t) (x >> 32);
+}
+
+/* Answers a getnodes request, ignoring anything else. */
+static void standin_handle_packet(DHT_Standin *net, Standin_Node *self, const uint8_t *packet, size_t len,
+                                  const struct sockaddr_in *from)
+{
+    if (len != STANDIN_REQUEST_SIZE || packet[0] != NET_PACKET_GET_NODES) {
+        return;
+    }
+
+    const uint8_t *client_key = packet + 1;
+    const uint8_t *nonce = packet + 1 + crypto_box_PUBLICKEYBYTES;
+    const uint8_t *cipher = nonce + crypto_box_NONCEBYTES;
+
+    if (!self->have_shared_key || memcmp(self->client_key, client_key, crypto_box_PUBLICKEYBYTES) != 0) {
+        if (crypto_box_beforenm(self->shared_key, client_key, self->secret_key) != 0) {
+            return;
+        }
+
+        memcpy(self->client_key, client_key, crypto_box_PUBLICKEYBYTES);
+        self->have_shared_key = true;
+    }
+
+    uint8_t request[crypto_box_PUBLICKEYBYTES + DHT_RAW_PING_ID_SIZE];
+
+    if (crypto_box_open_easy_afternm(request, cipher, len - (cipher - packet), nonce, self->shared_key) != 0) {
+        return;
+    }
+
+    const uint8_t num_sent = __atomic_load_n(&self->empty, __ATOMIC_RELAXED) ? 0 : DHT_RAW_MAX_SENT_NODES;
+    uint8_t plain[STANDIN_RESPONSE_PLAIN_SIZE];
+    uint8_t *p = plain;
+    *p++ = num_sent;
+
+    for (size_t i = 0; i < num_sent; ++i) {
+        const Standin_Node *node = &net->nodes[standin_rand(net) % net->num_nodes];
+        const uint32_t ip = htonl(INADDR_LOOPBACK);
+        const uint16_t port = htons(node->port);
+
+        *p++ = DHT_RAW_AF_INET;
+        memcpy(p, &ip, sizeof(ip));
+        p += sizeof(ip);
+        memcpy(p, &port, sizeof(port));
+        p += sizeof(port);
+        memcpy(p, node->public_key, crypto_box_PUBLICKEYBYTES);
+        p += crypto_box_PUBLICKEYBYTES;
+    }
+
+    memcpy(p, request + crypto_box_PUBLICKEYBYTES, DHT_RAW_PING_ID_SIZE);
+    p += DHT_RAW_PING_ID_SIZE;
+
+    const size_t plain_len = p - plain;
+    uint8_t response[STANDIN_RESPONSE_SIZE];
+    sodium_increment(net->nonce, sizeof(net->nonce));
+
+    response[0] = NET_PACKET_SEND_NODES_IPV6;
+    memcpy(response + 1, self->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(response + 1 + crypto_box_PUBLICKEYBYTES, net->nonce, crypto_box_NONCEBYTES);
+    crypto_box_easy_afternm(response + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, plain, plain_len,
+                            net->nonce, self->shared_key);
+
+    sendto(self->fd, response, STANDIN_RESPONSE_SIZE - sizeof(plain) + plain_len, 0, (const struct sockaddr *) from,
+           sizeof(struct sockaddr_in));
+
+    __atomic_add_fetch(&net->num_requests, 1, __ATOMIC_RELAXED);
+}
+
+static void standin_receive(DHT_Standin *net, Standin_Node *self)
+{
+    uint8_t bufs[STANDIN_BATCH_SIZE][STANDIN_REQUEST_SIZE + 1];
+    struct sockaddr_in addrs[STANDIN_BATCH_SIZE];
+    struct iovec iov[STANDIN_BATCH_SIZE];
+    struct mmsghdr msgs[STANDIN_BATCH_SIZE];
+
+    for (size_t i = 0; i < STANDIN_BATCH_SIZE; ++i) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    while (true) {
+        const int n = recvmmsg(self->fd, msgs, STANDIN_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+        if (n <= 0) {
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            standin_handle_packet(net, self, bufs[i], msgs[i].msg_len, &addrs[i]);
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+    }
+}
+
+static void *standin_thread(void *data)
+{
+    DHT_Standin *net = (DHT_Standin *) data;
+    struct epoll_event events[STANDIN_EPOLL_EVENTS];
+
+    while (!__atomic_load_n(&net->stop, __ATOMIC_RELAXED)) {
+        const int n = epoll_wait(net->epoll_fd, events, STANDIN_EPOLL_EVENTS, STANDIN_POLL_TIMEOUT);
+
+        for (int i = 0; i < n; ++i) {
+            standin_receive(net, &net->nodes[events[i].data.u32]);
+        }
+    }
+
+    return NULL;
+}
+
+static int standin_open_node(DHT_Standin *net, uint32_t i)
+{
+    Standin_Node *node = &net->nodes[i];
+    const int buf_size = 4 * 1024 * 1024;
+
+    node->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (node->fd == -1) {
+        return -1;
+    }
+
+    setsockopt(node->fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(node->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || getsockname(node->fd, (struct sockaddr *) &addr, &addr_len) != 0) {
+        return -1;
+    }
+
+    node->port = ntohs(addr.sin_port);
+    crypto_box_keypair(node->public_key, node->secret_key);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+
+    return epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, node->fd, &ev);
+}
+
+static void standin_free(DHT_Standin *net)
+{
+    for (uint32_t i = 0; i < net->num_nodes; ++i) {
+        if (net->nodes[i].fd != -1) {
+            close(net->nodes[i].fd);
+        }
+    }
+
+    if (net->epoll_fd != -1) {
+        close(net->epoll_fd);
+    }
+
+    free(net->nodes);
+    free(net);
+}
+
+DHT_Standin *dht_standin_new(uint32_t num_nodes)
+{
+    if (num_nodes == 0 || sodium_init() == -1) {
+        return NULL;
+    }
+
+    DHT_Standin *net = calloc(1, sizeof(DHT_Standin));
+
+    if (net == NULL) {
+        return NULL;
+    }
+
+    net->nodes = calloc(num_nodes, sizeof(Standin_Node));
+    net->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (net->nodes == NULL || net->epoll_fd == -1) {
+        standin_free(net);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        net->nodes[i].fd = -1;
+    }
+
+    net->num_nodes = num_nodes;
+    net->rng_state = 0x2545F4914F6CDD1DULL;
+    randombytes_buf(net->nonce, sizeof(net->nonce));
+
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        if (standin_open_node(net, i) != 0) {
+            standin_free(net);
+            return NULL;
+        }
+    }
+
+    if (pthread_create(&net->tid, NULL, standin_thread, net) != 0) {
+        standin_free(net);
+        return NULL;
+    }
+
+    return net;
+}
+
+void dht_standin_kill(DHT_Standin *net)
+{
+    if (net == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&net->stop, true, __ATOMIC_RELAXED);
+    pthread_join(net->tid, NULL);
+
+    standin_free(net);
+}
+
+void dht_standin_node(const DHT_Standin *net, uint32_t i, DHT_Node *node)
+{
+    const uint32_t ip = htonl(INADDR_LOOPBACK);
+
+    memset(node, 0, sizeof(DHT_Node));
+    memcpy(node->public_key, net->nodes[i].public_key, NODE_PUBLIC_KEY_SIZE);
+    memcpy(node->ip, &ip, sizeof(ip));
+    node->family = NODE_IPV4;
+    node->port = net->nodes[i].port;
+}
+
+void dht_standin_set_empty(DHT_Standin *net, uint32_t i, bool empty)
+{
+    __atomic_store_n(&net->nodes[i].empty, empty, __ATOMIC_RELAXED);
+}
+
+uint64_t dht_standin_requests(const DHT_Standin *net)
+{
+    return __atomic_load_n(&net->num_requests, __ATOMIC_RELAXED);
+}
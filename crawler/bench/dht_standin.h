@@ -0,0 +1,56 @@
+/*  dht_standin.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DHT_STANDIN_H
+#define DHT_STANDIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../src/nodes.h"
+
+/*
+ * A local stand-in for the Tox DHT.
+ *
+ * Each stand-in node has its own key pair and UDP socket on 127.0.0.1, and answers getnodes
+ * requests with DHT_RAW_MAX_SENT_NODES random other stand-in nodes. All nodes are served by a single
+ * background thread. This is written against the packet format directly rather than reusing
+ * dht_raw.c, so that the two check each other.
+ */
+typedef struct DHT_Standin DHT_Standin;
+
+/* Starts a network of num_nodes stand-in nodes. Returns NULL on failure. */
+DHT_Standin *dht_standin_new(uint32_t num_nodes);
+
+/* Stops the network and frees it. */
+void dht_standin_kill(DHT_Standin *net);
+
+/* Puts the address and public key of stand-in node i in node. */
+void dht_standin_node(const DHT_Standin *net, uint32_t i, DHT_Node *node);
+
+/* Makes stand-in node i answer with an empty node list, like a node that knows no one yet. */
+void dht_standin_set_empty(DHT_Standin *net, uint32_t i, bool empty);
+
+/* Returns the number of valid getnodes requests answered so far. */
+uint64_t dht_standin_requests(const DHT_Standin *net);
+
+#endif  /* DHT_STANDIN_H */
@@ -0,0 +1,521 @@
+/*  autoscale.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autoscale.h"
+
+/* Number of entries in the table of which crawler found each node last. Must be a power of 2. */
+#define AUTOSCALE_OWNER_TABLE_BITS 19
+#define AUTOSCALE_OWNER_TABLE_SIZE (1 << AUTOSCALE_OWNER_TABLE_BITS)
+
+/* Yield reported for a crawler that found nodes without using measurable CPU time */
+#define AUTOSCALE_MAX_YIELD 1e12
+
+/* Weight of the newest sample in the smoothed discovery rate and yield. At 0.25 a crawler that stops
+ * finding nodes takes about 11 samples to drop below 5% of its rate. */
+#define AUTOSCALE_SAMPLE_WEIGHT 0.25
+
+struct Autoscale_Slot {
+    uint32_t id;   /* 0 if the slot is free */
+    time_t   started;
+    uint32_t num_nodes;
+    uint64_t covered;   /* crawler id in the high 32 bits and the number of its nodes that a newer crawler has
+                           also found in the low 32 bits, so a credit can't land on a reused slot */
+    uint32_t passes;
+    uint64_t cpu_ns;
+    bool     stop;
+
+    /* Only used by the supervisor */
+    uint32_t last_nodes;
+    uint64_t last_cpu_ns;
+    uint64_t last_sample_ns;
+    Autoscale_Crawler signals;
+};
+
+static Autoscale_Slot autoscale_slots[AUTOSCALE_MAX_SLOTS];
+static uint32_t autoscale_last_id;
+
+/* Id of the newest crawler that found each node, indexed by a hash of its public key. Cleared whenever a
+ * crawler is registered while none are running, so one generation of crawlers never sees another's nodes. */
+static uint32_t autoscale_owners[AUTOSCALE_OWNER_TABLE_SIZE];
+
+static struct {
+    bool     valid;
+    uint64_t cpu_busy;
+    uint64_t cpu_total;
+    uint64_t udp_drops;
+    uint64_t time_ns;
+} autoscale_host_prev;
+
+static uint64_t autoscale_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void autoscale_default_config(Autoscale_Config *config)
+{
+    config->min_crawlers = AUTOSCALE_DEFAULT_MIN_CRAWLERS;
+    config->max_crawlers = AUTOSCALE_DEFAULT_MAX_CRAWLERS;
+    config->min_start_interval = 60;
+    config->max_start_interval = 180;
+    config->warmup = 60;
+    config->max_cpu_load = 0.9;
+    config->max_udp_drops = 50.0;
+    config->tail_fraction = 0.05;
+    config->max_overlap = 0.9;
+    config->min_yield = 0.5;
+}
+
+void autoscale_add_sample(Autoscale_Crawler *crawler, uint32_t new_nodes, double secs, double cpu_secs)
+{
+    const double rate = secs > 0 ? new_nodes / secs : 0.0;
+    const double yield = cpu_secs > 0 ? new_nodes / cpu_secs : (new_nodes > 0 ? AUTOSCALE_MAX_YIELD : 0.0);
+
+    if (crawler->num_samples == 0) {
+        crawler->discovery_rate = rate;
+        crawler->yield = yield;
+    } else {
+        crawler->discovery_rate += AUTOSCALE_SAMPLE_WEIGHT * (rate - crawler->discovery_rate);
+        crawler->yield += AUTOSCALE_SAMPLE_WEIGHT * (yield - crawler->yield);
+    }
+
+    ++crawler->num_samples;
+
+    if (crawler->discovery_rate > crawler->peak_rate) {
+        crawler->peak_rate = crawler->discovery_rate;
+    }
+}
+
+static bool autoscale_in_tail(const Autoscale_Config *config, const Autoscale_Crawler *crawler)
+{
+    if (crawler->age < config->warmup) {
+        return false;
+    }
+
+    /* A crawler that hasn't found anything since its warmup has no bulk to get through */
+    return crawler->peak_rate <= 0.0 || crawler->discovery_rate < config->tail_fraction * crawler->peak_rate;
+}
+
+/*
+ * A crawler has to be in its tail before it is stopped, so that every crawl gets through its bulk.
+ * Among tailing crawlers we stop the oldest one that has either been superseded by a newer crawler,
+ * finds too little for the CPU it burns, or is holding back a host that is overloaded.
+ */
+Autoscale_Decision autoscale_decide(const Autoscale_Config *config, const Autoscale_Host *host,
+                                    const Autoscale_Crawler *crawlers, uint16_t num_crawlers,
+                                    time_t since_last_start)
+{
+    Autoscale_Decision decision = { AUTOSCALE_NONE, 0, NULL };
+    const bool overloaded = host->cpu_load > config->max_cpu_load || host->udp_drops > config->max_udp_drops;
+
+    if (num_crawlers > config->min_crawlers) {
+        for (uint16_t i = 0; i < num_crawlers; ++i) {
+            const Autoscale_Crawler *crawler = &crawlers[i];
+
+            if (crawler->passes == 0 || !autoscale_in_tail(config, crawler)) {
+                continue;
+            }
+
+            if (crawler->overlap >= config->max_overlap) {
+                decision.reason = "superseded by a newer crawler";
+            } else if (crawler->yield < config->min_yield) {
+                decision.reason = "low yield per CPU second";
+            } else if (overloaded) {
+                decision.reason = "host overloaded";
+            } else {
+                continue;
+            }
+
+            decision.action = AUTOSCALE_STOP;
+            decision.crawler_id = crawler->id;
+
+            return decision;
+        }
+    }
+
+    if (num_crawlers < config->min_crawlers) {
+        decision.action = AUTOSCALE_START;
+        decision.reason = "below minimum";
+        return decision;
+    }
+
+    decision.action = AUTOSCALE_DELAY;
+
+    if (num_crawlers >= config->max_crawlers) {
+        decision.reason = "at maximum";
+    } else if (since_last_start < config->min_start_interval) {
+        decision.reason = "started one recently";
+    } else if (overloaded) {
+        decision.reason = "host overloaded";
+    } else if (num_crawlers == 0 || autoscale_in_tail(config, &crawlers[num_crawlers - 1])) {
+        decision.action = AUTOSCALE_START;
+        decision.reason = "newest crawler is in its tail";
+    } else if (since_last_start >= config->max_start_interval) {
+        decision.action = AUTOSCALE_START;
+        decision.reason = "newest crawler is getting stale";
+    } else {
+        decision.reason = "newest crawler is still finding nodes";
+    }
+
+    return decision;
+}
+
+/*
+ * Reads the busy and total CPU time of the host in clock ticks.
+ *
+ * Returns 0 on success.
+ * Returns -1 if /proc/stat cannot be read.
+ */
+static int autoscale_read_cpu(uint64_t *busy, uint64_t *total)
+{
+    FILE *fp = fopen("/proc/stat", "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    unsigned long long v[8] = {0};
+    const int n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+                         &v[6], &v[7]);
+    fclose(fp);
+
+    if (n < 4) {
+        return -1;
+    }
+
+    *total = 0;
+
+    for (size_t i = 0; i < 8; ++i) {
+        *total += v[i];
+    }
+
+    /* idle and iowait */
+    *busy = *total - v[3] - v[4];
+
+    return 0;
+}
+
+/*
+ * Finds the value of field in a pair of header and value lines from /proc/net/snmp, e.g.
+ * "Udp: InDatagrams NoPorts ..." and "Udp: 1234 5 ...".
+ *
+ * Returns 0 on success.
+ * Returns -1 if the field is not in the header.
+ */
+static int autoscale_snmp_field(char *header, char *values, const char *field, uint64_t *value)
+{
+    char *hsave, *vsave;
+    char *name = strtok_r(header, " \n", &hsave);
+    char *val = strtok_r(values, " \n", &vsave);
+
+    while (name != NULL && val != NULL) {
+        if (strcmp(name, field) == 0) {
+            *value = strtoull(val, NULL, 10);
+            return 0;
+        }
+
+        name = strtok_r(NULL, " \n", &hsave);
+        val = strtok_r(NULL, " \n", &vsave);
+    }
+
+    return -1;
+}
+
+/*
+ * Reads the number of UDP datagrams the host has dropped on receive because a socket buffer was
+ * full, over IPv4 and IPv6.
+ *
+ * Returns 0 on success.
+ * Returns -1 if /proc/net/snmp cannot be read or has no such counter.
+ */
+static int autoscale_read_udp_drops(uint64_t *drops)
+{
+    FILE *fp = fopen("/proc/net/snmp", "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char header[1024];
+    char values[1024];
+    int ret = -1;
+
+    while (fgets(header, sizeof(header), fp) != NULL) {
+        if (strncmp(header, "Udp:", 4) != 0) {
+            continue;
+        }
+
+        if (fgets(values, sizeof(values), fp) != NULL) {
+            ret = autoscale_snmp_field(header, values, "RcvbufErrors", drops);
+        }
+
+        break;
+    }
+
+    fclose(fp);
+
+    if (ret != 0) {
+        return -1;
+    }
+
+    fp = fopen("/proc/net/snmp6", "r");
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    unsigned long long value;
+
+    while (fgets(header, sizeof(header), fp) != NULL) {
+        if (sscanf(header, "Udp6RcvbufErrors %llu", &value) == 1) {
+            *drops += value;
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+static void autoscale_sample_host(Autoscale_Host *host, uint64_t now_ns)
+{
+    uint64_t cpu_busy = 0, cpu_total = 0, udp_drops = 0;
+    const bool valid = autoscale_read_cpu(&cpu_busy, &cpu_total) == 0 && autoscale_read_udp_drops(&udp_drops) == 0;
+
+    memset(host, 0, sizeof(Autoscale_Host));
+
+    if (valid && autoscale_host_prev.valid && cpu_total > autoscale_host_prev.cpu_total) {
+        const double secs = (double) (now_ns - autoscale_host_prev.time_ns) / 1e9;
+
+        host->cpu_load = (double) (cpu_busy - autoscale_host_prev.cpu_busy) / (cpu_total - autoscale_host_prev.cpu_total);
+
+        if (secs > 0 && udp_drops >= autoscale_host_prev.udp_drops) {
+            host->udp_drops = (double) (udp_drops - autoscale_host_prev.udp_drops) / secs;
+        }
+    }
+
+    autoscale_host_prev.valid = valid;
+    autoscale_host_prev.cpu_busy = cpu_busy;
+    autoscale_host_prev.cpu_total = cpu_total;
+    autoscale_host_prev.udp_drops = udp_drops;
+    autoscale_host_prev.time_ns = now_ns;
+}
+
+/* Adds the crawler's activity since the previous sample to its signals and copies them to crawler. */
+static void autoscale_sample_crawler(Autoscale_Slot *slot, Autoscale_Crawler *crawler, uint64_t now_ns)
+{
+    const uint32_t num_nodes = __atomic_load_n(&slot->num_nodes, __ATOMIC_RELAXED);
+    const uint32_t passes = __atomic_load_n(&slot->passes, __ATOMIC_RELAXED);
+    const uint64_t cpu_ns = __atomic_load_n(&slot->cpu_ns, __ATOMIC_RELAXED);
+    const uint32_t covered = (uint32_t) __atomic_load_n(&slot->covered, __ATOMIC_RELAXED);
+
+    const double secs = (double) (now_ns - slot->last_sample_ns) / 1e9;
+    const double cpu_secs = (double) (cpu_ns - slot->last_cpu_ns) / 1e9;
+    const uint32_t new_nodes = num_nodes - slot->last_nodes;
+
+    Autoscale_Crawler *signals = &slot->signals;
+    autoscale_add_sample(signals, new_nodes, secs, cpu_secs);
+
+    signals->id = slot->id;
+    signals->age = time(NULL) - slot->started;
+    signals->num_nodes = num_nodes;
+    signals->passes = passes;
+    signals->overlap = num_nodes > 0 ? (double) covered / num_nodes : 0.0;
+
+    *crawler = *signals;
+
+    slot->last_nodes = num_nodes;
+    slot->last_cpu_ns = cpu_ns;
+    slot->last_sample_ns = now_ns;
+}
+
+static int autoscale_cmp_crawlers(const void *a, const void *b)
+{
+    const uint32_t id_a = ((const Autoscale_Crawler *) a)->id;
+    const uint32_t id_b = ((const Autoscale_Crawler *) b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+Autoscale_Decision autoscale_update(const Autoscale_Config *config, time_t since_last_start)
+{
+    const uint64_t now_ns = autoscale_now_ns();
+    Autoscale_Host host;
+    Autoscale_Crawler crawlers[AUTOSCALE_MAX_SLOTS];
+    uint16_t num_crawlers = 0;
+
+    autoscale_sample_host(&host, now_ns);
+
+    for (size_t i = 0; i < AUTOSCALE_MAX_SLOTS; ++i) {
+        Autoscale_Slot *slot = &autoscale_slots[i];
+
+        if (__atomic_load_n(&slot->id, __ATOMIC_ACQUIRE) != 0) {
+            autoscale_sample_crawler(slot, &crawlers[num_crawlers++], now_ns);
+        }
+    }
+
+    qsort(crawlers, num_crawlers, sizeof(Autoscale_Crawler), autoscale_cmp_crawlers);
+
+    return autoscale_decide(config, &host, crawlers, num_crawlers, since_last_start);
+}
+
+uint16_t autoscale_num_crawlers(void)
+{
+    uint16_t count = 0;
+
+    for (size_t i = 0; i < AUTOSCALE_MAX_SLOTS; ++i) {
+        count += __atomic_load_n(&autoscale_slots[i].id, __ATOMIC_ACQUIRE) != 0;
+    }
+
+    return count;
+}
+
+/* Returns the slot of the registered crawler with the given id, or NULL if it has finished. */
+static Autoscale_Slot *autoscale_find_slot(uint32_t id)
+{
+    for (size_t i = 0; i < AUTOSCALE_MAX_SLOTS; ++i) {
+        if (__atomic_load_n(&autoscale_slots[i].id, __ATOMIC_ACQUIRE) == id) {
+            return &autoscale_slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+void autoscale_request_stop(uint32_t id)
+{
+    Autoscale_Slot *slot = autoscale_find_slot(id);
+
+    if (slot != NULL) {
+        __atomic_store_n(&slot->stop, true, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Slots are only taken by the supervisor thread, so there's no race between two registrations. Slots are
+ * released by crawler threads after their last call to autoscale_note_node(), so if none is registered
+ * nothing else can be using the owner table.
+ */
+Autoscale_Slot *autoscale_register(void)
+{
+    if (autoscale_num_crawlers() == 0) {
+        memset(autoscale_owners, 0, sizeof(autoscale_owners));
+    }
+
+    for (size_t i = 0; i < AUTOSCALE_MAX_SLOTS; ++i) {
+        Autoscale_Slot *slot = &autoscale_slots[i];
+
+        if (__atomic_load_n(&slot->id, __ATOMIC_ACQUIRE) != 0) {
+            continue;
+        }
+
+        const uint32_t id = ++autoscale_last_id;
+        const uint64_t covered = (uint64_t) id << 32;
+
+        memset(slot, 0, sizeof(Autoscale_Slot));
+        slot->started = time(NULL);
+        slot->last_sample_ns = autoscale_now_ns();
+        __atomic_store_n(&slot->covered, covered, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+
+        return slot;
+    }
+
+    return NULL;
+}
+
+void autoscale_release(Autoscale_Slot *slot)
+{
+    __atomic_store_n(&slot->covered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->id, 0, __ATOMIC_RELEASE);
+}
+
+void autoscale_report(Autoscale_Slot *slot, uint32_t num_nodes, uint32_t passes, uint64_t cpu_ns)
+{
+    __atomic_store_n(&slot->num_nodes, num_nodes, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->passes, passes, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->cpu_ns, cpu_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Adds one covered node to the crawler with the given id in slot. Does nothing if that crawler has
+ * released the slot in the meantime, even if another crawler has taken it since.
+ */
+static void autoscale_credit(Autoscale_Slot *slot, uint32_t id)
+{
+    uint64_t covered = __atomic_load_n(&slot->covered, __ATOMIC_RELAXED);
+
+    while (covered >> 32 == id) {
+        if (__atomic_compare_exchange_n(&slot->covered, &covered, covered + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Records that the crawler in slot found public_key. If a running newer crawler found it already, or an
+ * older one found it before, the older crawler's copy counts as covered. Hash collisions make this an
+ * estimate.
+ */
+void autoscale_note_node(Autoscale_Slot *slot, const uint8_t *public_key)
+{
+    uint64_t h;
+    memcpy(&h, public_key, sizeof(h));
+
+    uint32_t *owner = &autoscale_owners[(h * 0x9E3779B97F4A7C15ULL) >> (64 - AUTOSCALE_OWNER_TABLE_BITS)];
+    const uint32_t id = slot->id;
+    uint32_t old = __atomic_load_n(owner, __ATOMIC_RELAXED);
+
+    while (old < id && !__atomic_compare_exchange_n(owner, &old, id, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (old == 0 || old == id) {
+        return;
+    }
+
+    if (old > id) {
+        /* The newer crawler may have finished, in which case it no longer supersedes us */
+        if (autoscale_find_slot(old) != NULL) {
+            autoscale_credit(slot, id);
+        }
+
+        return;
+    }
+
+    Autoscale_Slot *older = autoscale_find_slot(old);
+
+    if (older != NULL) {
+        autoscale_credit(older, old);
+    }
+}
+
+bool autoscale_stop_requested(const Autoscale_Slot *slot)
+{
+    return __atomic_load_n(&slot->stop, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,139 @@
+/*  autoscale.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef AUTOSCALE_H
+#define AUTOSCALE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Decides when the supervisor starts, delays or stops crawler instances.
+ *
+ * Each crawler registers a slot that its thread keeps up to date with its node count and CPU time,
+ * and reports every new node it finds. New nodes are recorded in a table shared by all crawlers,
+ * which tells us how much of an older crawler's nodes list has been found again by a newer one. The
+ * supervisor combines these with host CPU load and UDP receive drops from /proc.
+ */
+
+/* Upper bound for the number of concurrent crawlers */
+#define AUTOSCALE_MAX_SLOTS 64
+
+#define AUTOSCALE_DEFAULT_MIN_CRAWLERS 1
+#define AUTOSCALE_DEFAULT_MAX_CRAWLERS 4
+
+typedef struct Autoscale_Config {
+    uint16_t min_crawlers;
+    uint16_t max_crawlers;
+    time_t   min_start_interval;   /* seconds between two crawler starts */
+    time_t   max_start_interval;   /* start a crawler after this long even if the newest one is still finding nodes */
+    time_t   warmup;               /* seconds before a crawler can be considered to be in its tail */
+    double   max_cpu_load;         /* host CPU busy fraction above which we are overloaded */
+    double   max_udp_drops;        /* host UDP receive drops per second above which we are overloaded */
+    double   tail_fraction;        /* a crawler finding nodes at less than this fraction of its peak rate is in its tail */
+    double   max_overlap;          /* stop a tailing crawler once this fraction of its nodes was found again by a newer one */
+    double   min_yield;            /* stop a tailing crawler that finds fewer new nodes than this per CPU second */
+} Autoscale_Config;
+
+/* Host load over the last update interval */
+typedef struct Autoscale_Host {
+    double cpu_load;    /* fraction of CPU time that was busy, 0 to 1 */
+    double udp_drops;   /* UDP datagrams dropped on receive per second */
+} Autoscale_Host;
+
+/* Signals for one crawler. Rates are smoothed over samples so a single quiet interval doesn't look like a tail. */
+typedef struct Autoscale_Crawler {
+    uint32_t id;   /* increases with start time */
+    time_t   age;
+    uint32_t num_nodes;
+    uint32_t passes;           /* full passes made through its nodes list */
+    uint32_t num_samples;
+    double   discovery_rate;   /* new nodes per second */
+    double   peak_rate;        /* highest discovery_rate seen so far */
+    double   yield;            /* new nodes per CPU second */
+    double   overlap;          /* fraction of its nodes that a newer crawler also found */
+} Autoscale_Crawler;
+
+typedef enum Autoscale_Action {
+    AUTOSCALE_NONE,
+    AUTOSCALE_START,
+    AUTOSCALE_DELAY,   /* a crawler is wanted but not yet */
+    AUTOSCALE_STOP,
+} Autoscale_Action;
+
+typedef struct Autoscale_Decision {
+    Autoscale_Action action;
+    uint32_t         crawler_id;   /* crawler to stop */
+    const char       *reason;
+} Autoscale_Decision;
+
+/* Crawler state shared between a crawler thread and the supervisor. */
+typedef struct Autoscale_Slot Autoscale_Slot;
+
+void autoscale_default_config(Autoscale_Config *config);
+
+/*
+ * Adds a sample of new_nodes found in secs seconds using cpu_secs seconds of CPU time to the smoothed
+ * discovery rate, peak rate and yield of crawler.
+ */
+void autoscale_add_sample(Autoscale_Crawler *crawler, uint32_t new_nodes, double secs, double cpu_secs);
+
+/*
+ * Decides what to do next. crawlers must be sorted from oldest to newest. since_last_start is the
+ * number of seconds since the last crawler was started.
+ *
+ * At most one crawler is stopped per decision, only while more than min_crawlers are running, and
+ * only once it has made a full pass through its nodes list, so that every log covers a whole pass.
+ */
+Autoscale_Decision autoscale_decide(const Autoscale_Config *config, const Autoscale_Host *host,
+                                    const Autoscale_Crawler *crawlers, uint16_t num_crawlers,
+                                    time_t since_last_start);
+
+/*
+ * Samples host and crawler signals since the previous call and decides what to do next.
+ * Host signals that cannot be read are treated as idle.
+ */
+Autoscale_Decision autoscale_update(const Autoscale_Config *config, time_t since_last_start);
+
+/* Returns the number of registered crawlers. */
+uint16_t autoscale_num_crawlers(void);
+
+/* Asks the crawler with the given id to finish. */
+void autoscale_request_stop(uint32_t id);
+
+/* Registers a new crawler and returns its slot, or NULL if all slots are taken. */
+Autoscale_Slot *autoscale_register(void);
+
+/* Releases a slot once its crawler has finished. */
+void autoscale_release(Autoscale_Slot *slot);
+
+/* Called by the crawler thread to publish its node count, number of passes and the CPU time it has used. */
+void autoscale_report(Autoscale_Slot *slot, uint32_t num_nodes, uint32_t passes, uint64_t cpu_ns);
+
+/* Called by the crawler thread for every new node it finds. */
+void autoscale_note_node(Autoscale_Slot *slot, const uint8_t *public_key);
+
+/* Returns true if the supervisor has asked the crawler to finish. */
+bool autoscale_stop_requested(const Autoscale_Slot *slot);
+
+#endif  /* AUTOSCALE_H */
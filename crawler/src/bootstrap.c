@@ -0,0 +1,318 @@
+/*  bootstrap.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootstrap.h"
+#include "dht_raw.h"
+#include "util.h"
+
+/* Weight of a new round trip time sample in the smoothed value */
+#define BOOTSTRAP_RTT_WEIGHT 0.3
+
+/* Milliseconds to sleep between checks for probe responses */
+#define BOOTSTRAP_PROBE_POLL 1
+
+#define BOOTSTRAP_TEMP_FILE_EXT ".tmp"
+
+typedef struct Bootstrap_Probe {
+    Bootstrap_List *list;
+    uint64_t       start_ns;
+    double         rtt_ms[BOOTSTRAP_MAX_NODES];   /* 0 until the candidate answers */
+    uint16_t       num_answered;
+} Bootstrap_Probe;
+
+static uint64_t bootstrap_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int bootstrap_find(const Bootstrap_List *list, const uint8_t *public_key)
+{
+    for (uint16_t i = 0; i < list->num_nodes; ++i) {
+        if (memcmp(list->nodes[i].node.public_key, public_key, NODE_PUBLIC_KEY_SIZE) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int bootstrap_add(Bootstrap_List *list, const char *ip, uint16_t port, const char *hex_key)
+{
+    if (list->num_nodes >= BOOTSTRAP_MAX_NODES) {
+        return -2;
+    }
+
+    Bootstrap_Node *bs = &list->nodes[list->num_nodes];
+    memset(bs, 0, sizeof(Bootstrap_Node));
+
+    if (port == 0 || node_ip_parse(&bs->node, ip) != 0
+            || hex_string_to_bin(hex_key, strlen(hex_key), (char *) bs->node.public_key, NODE_PUBLIC_KEY_SIZE) != 0) {
+        return -1;
+    }
+
+    bs->node.port = port;
+    ++list->num_nodes;
+
+    return 0;
+}
+
+int bootstrap_load_list(Bootstrap_List *list, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    unsigned int line_num = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ++line_num;
+
+        char ip[NODE_IP_STRING_SIZE];
+        char key[NODE_PUBLIC_KEY_SIZE * 2 + 1];
+        unsigned int port;
+
+        if (line[0] == '#' || sscanf(line, "%47s", ip) != 1) {
+            continue;
+        }
+
+        if (sscanf(line, "%47s %u %64s", ip, &port, key) != 3 || port > UINT16_MAX
+                || bootstrap_add(list, ip, port, key) != 0) {
+            fprintf(stderr, "Skipping invalid bootstrap node on line %u of %s\n", line_num, path);
+            continue;
+        }
+
+        ++count;
+    }
+
+    fclose(fp);
+
+    return count;
+}
+
+int bootstrap_load_scores(Bootstrap_List *list, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[256];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char hex_key[NODE_PUBLIC_KEY_SIZE * 2 + 1];
+        uint8_t key[NODE_PUBLIC_KEY_SIZE];
+        double rtt_ms;
+        unsigned int successes, failures;
+        long long last_seen;
+
+        if (sscanf(line, "%64s %lf %u %u %lld", hex_key, &rtt_ms, &successes, &failures, &last_seen) != 5
+                || hex_string_to_bin(hex_key, strlen(hex_key), (char *) key, sizeof(key)) != 0) {
+            continue;
+        }
+
+        const int i = bootstrap_find(list, key);
+
+        if (i == -1) {
+            continue;
+        }
+
+        Bootstrap_Node *bs = &list->nodes[i];
+        bs->rtt_ms = rtt_ms;
+        bs->successes = successes;
+        bs->failures = failures;
+        bs->last_seen = last_seen;
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+int bootstrap_save_scores(const Bootstrap_List *list, const char *path)
+{
+    char path_temp[strlen(path) + strlen(BOOTSTRAP_TEMP_FILE_EXT) + 1];
+    snprintf(path_temp, sizeof(path_temp), "%s%s", path, BOOTSTRAP_TEMP_FILE_EXT);
+
+    FILE *fp = fopen(path_temp, "w");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    for (uint16_t i = 0; i < list->num_nodes; ++i) {
+        const Bootstrap_Node *bs = &list->nodes[i];
+
+        for (size_t j = 0; j < NODE_PUBLIC_KEY_SIZE; ++j) {
+            fprintf(fp, "%02X", bs->node.public_key[j]);
+        }
+
+        fprintf(fp, " %.3f %u %u %lld\n", bs->rtt_ms, bs->successes, bs->failures, (long long) bs->last_seen);
+    }
+
+    if (fclose(fp) != 0) {
+        remove(path_temp);
+        return -1;
+    }
+
+    if (rename(path_temp, path) != 0) {
+        return -2;
+    }
+
+    return 0;
+}
+
+/* A response only counts once the candidate gives us at least one node, since that's what seeding needs */
+static void bootstrap_probe_response(void *user_data, const uint8_t *responder_key, const DHT_Node *node)
+{
+    Bootstrap_Probe *probe = (Bootstrap_Probe *) user_data;
+
+    if (node == NULL) {
+        return;
+    }
+
+    const int i = bootstrap_find(probe->list, responder_key);
+
+    if (i == -1 || probe->rtt_ms[i] != 0) {
+        return;
+    }
+
+    const double rtt_ms = (double) (bootstrap_now_ns() - probe->start_ns) / 1e6;
+
+    /* 0 means no answer, and loopback answers can be faster than the clock's resolution */
+    probe->rtt_ms[i] = rtt_ms > 0 ? rtt_ms : 1e-6;
+    ++probe->num_answered;
+}
+
+int bootstrap_probe(Bootstrap_List *list, uint32_t timeout_ms)
+{
+    DHT_Raw *dht = dht_raw_new(1, bootstrap_probe_response);
+
+    if (dht == NULL) {
+        return -1;
+    }
+
+    Bootstrap_Probe probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.list = list;
+
+    uint16_t num_sent = 0;
+
+    for (uint16_t i = 0; i < list->num_nodes; ++i) {
+        const DHT_Node *node = &list->nodes[i].node;
+        num_sent += dht_raw_get_nodes(dht, node, node->public_key);
+    }
+
+    probe.start_ns = bootstrap_now_ns();
+    const uint64_t deadline = probe.start_ns + (uint64_t) timeout_ms * 1000000ULL;
+
+    while (probe.num_answered < num_sent && bootstrap_now_ns() < deadline) {
+        dht_raw_iterate(dht, &probe);
+        usleep(BOOTSTRAP_PROBE_POLL * 1000);
+    }
+
+    dht_raw_kill(dht);
+
+    const time_t now = get_time();
+
+    for (uint16_t i = 0; i < list->num_nodes; ++i) {
+        Bootstrap_Node *bs = &list->nodes[i];
+
+        if (probe.rtt_ms[i] == 0) {
+            ++bs->failures;
+            continue;
+        }
+
+        bs->rtt_ms = bs->successes == 0 ? probe.rtt_ms[i]
+                     : (1.0 - BOOTSTRAP_RTT_WEIGHT) * bs->rtt_ms + BOOTSTRAP_RTT_WEIGHT * probe.rtt_ms[i];
+        ++bs->successes;
+        bs->failures = 0;
+        bs->last_seen = now;
+    }
+
+    list->last_probe = now;
+
+    return probe.num_answered;
+}
+
+bool bootstrap_healthy(const Bootstrap_Node *node)
+{
+    return node->successes > 0 && node->failures == 0;
+}
+
+/* 0 for healthy, 1 for untested, 2 for failing */
+static int bootstrap_health_class(const Bootstrap_Node *node)
+{
+    if (bootstrap_healthy(node)) {
+        return 0;
+    }
+
+    return node->successes == 0 && node->failures == 0 ? 1 : 2;
+}
+
+static int bootstrap_cmp(const Bootstrap_Node *na, const Bootstrap_Node *nb)
+{
+    const int ca = bootstrap_health_class(na);
+    const int cb = bootstrap_health_class(nb);
+
+    if (ca != cb) {
+        return ca - cb;
+    }
+
+    if (ca == 2 && na->failures != nb->failures) {
+        return na->failures < nb->failures ? -1 : 1;
+    }
+
+    /* An rtt of 0 means it never answered, which is worse than any rtt */
+    if (ca == 2 && (na->successes == 0) != (nb->successes == 0)) {
+        return na->successes == 0 ? 1 : -1;
+    }
+
+    return (na->rtt_ms > nb->rtt_ms) - (na->rtt_ms < nb->rtt_ms);
+}
+
+/* Insertion sort, since it is stable and keeps untested candidates in the order they were listed */
+void bootstrap_rank(Bootstrap_List *list)
+{
+    for (uint16_t i = 1; i < list->num_nodes; ++i) {
+        const Bootstrap_Node tmp = list->nodes[i];
+        uint16_t j = i;
+
+        while (j > 0 && bootstrap_cmp(&list->nodes[j - 1], &tmp) > 0) {
+            list->nodes[j] = list->nodes[j - 1];
+            --j;
+        }
+
+        list->nodes[j] = tmp;
+    }
+}
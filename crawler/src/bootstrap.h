@@ -0,0 +1,109 @@
+/*  bootstrap.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "nodes.h"
+
+/*
+ * Bootstrap node candidates with a latency and liveness score for each.
+ *
+ * Candidates are probed all at once with a getnodes request through a raw DHT client. A candidate
+ * that answers with at least one node is healthy; its round trip time is smoothed over probes.
+ * Scores are persisted between runs and matched to candidates by public key.
+ */
+
+#define BOOTSTRAP_MAX_NODES 256
+
+typedef struct Bootstrap_Node {
+    DHT_Node node;
+    double   rtt_ms;      /* smoothed round trip time, 0 if it never answered */
+    uint32_t successes;   /* number of probes answered */
+    uint32_t failures;    /* number of consecutive probes not answered */
+    time_t   last_seen;
+} Bootstrap_Node;
+
+typedef struct Bootstrap_List {
+    Bootstrap_Node nodes[BOOTSTRAP_MAX_NODES];
+    uint16_t       num_nodes;
+    time_t         last_probe;
+} Bootstrap_List;
+
+/*
+ * Adds a candidate to list.
+ *
+ * Returns 0 on success.
+ * Returns -1 if ip or hex_key is invalid.
+ * Returns -2 if the list is full.
+ */
+int bootstrap_add(Bootstrap_List *list, const char *ip, uint16_t port, const char *hex_key);
+
+/*
+ * Adds the candidates listed in the file at path to list. Each line holds an IP address, a port and
+ * a public key in hex, separated by whitespace. Empty lines and lines starting with # are ignored.
+ *
+ * Returns the number of candidates added.
+ * Returns -1 if the file cannot be opened.
+ */
+int bootstrap_load_list(Bootstrap_List *list, const char *path);
+
+/*
+ * Loads the scores of the candidates in list from path. Scores of keys that are not in the list are
+ * ignored.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be opened.
+ */
+int bootstrap_load_scores(Bootstrap_List *list, const char *path);
+
+/*
+ * Writes the scores of the candidates in list to path.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be written.
+ * Returns -2 if the file cannot be renamed.
+ */
+int bootstrap_save_scores(const Bootstrap_List *list, const char *path);
+
+/*
+ * Probes every candidate at once and updates their scores. Waits until all of them have answered or
+ * timeout_ms milliseconds have passed.
+ *
+ * Returns the number of candidates that answered.
+ * Returns -1 if the probe client cannot be created.
+ */
+int bootstrap_probe(Bootstrap_List *list, uint32_t timeout_ms);
+
+/* Sorts candidates by health and then by round trip time, fastest first. Untested candidates come
+ * after healthy ones and before failing ones, which are sorted by their number of consecutive failures
+ * and then put the ones that have ever answered first. */
+void bootstrap_rank(Bootstrap_List *list);
+
+/* Returns true if the candidate answered its last probe. */
+bool bootstrap_healthy(const Bootstrap_Node *node);
+
+#endif  /* BOOTSTRAP_H */
@@ -0,0 +1,595 @@
+/*  dht_raw.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#define _GNU_SOURCE  /* for sendmmsg() and recvmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <sodium.h>
+
+#include "dht_raw.h"
+#include "util.h"
+
+/* Max number of packets sent or received per system call */
+#define DHT_RAW_BATCH_SIZE 64
+
+/* Max number of receive batches handled per socket per iteration */
+#define DHT_RAW_MAX_RECV_BATCHES 32
+
+/* Initial and maximum number of slots in the shared key cache. Computing a shared key costs a
+ * curve25519 scalar multiplication, so the cache is what keeps repeated requests to a node cheap. It
+ * grows with the set of nodes we send requests to, and holds up to 3/4 of its maximum size in keys,
+ * which is more than the number of nodes in the DHT. */
+#define DHT_RAW_KEY_CACHE_MIN_SIZE 4096     /* must be a power of 2 */
+#define DHT_RAW_KEY_CACHE_MAX_SIZE 131072   /* must be a power of 2 */
+
+/* Seconds that the sendback data of a request stays valid */
+#define DHT_RAW_RESPONSE_TIMEOUT 10
+
+/* Milliseconds between iterations */
+#define DHT_RAW_ITERATION_INTERVAL 5
+
+/* Requested socket buffer size in bytes */
+#define DHT_RAW_SOCKET_BUF_SIZE (4 * 1024 * 1024)
+
+#define DHT_RAW_HEADER_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES)
+
+#define DHT_RAW_REQUEST_PLAIN_SIZE (crypto_box_PUBLICKEYBYTES + DHT_RAW_PING_ID_SIZE)
+#define DHT_RAW_REQUEST_SIZE (DHT_RAW_HEADER_SIZE + DHT_RAW_REQUEST_PLAIN_SIZE + crypto_box_MACBYTES)
+
+#define DHT_RAW_PACKED_NODE_MAX_SIZE (1 + 16 + sizeof(uint16_t) + crypto_box_PUBLICKEYBYTES)
+#define DHT_RAW_RESPONSE_PLAIN_MAX_SIZE (1 + DHT_RAW_MAX_SENT_NODES * DHT_RAW_PACKED_NODE_MAX_SIZE + DHT_RAW_PING_ID_SIZE)
+#define DHT_RAW_RESPONSE_MIN_SIZE (DHT_RAW_HEADER_SIZE + crypto_box_MACBYTES + 1 + DHT_RAW_PING_ID_SIZE)
+
+/* Large enough for any response; bigger packets are truncated and fail to decrypt */
+#define DHT_RAW_RECV_SIZE 512
+
+typedef struct DHT_Raw_Socket {
+    int      fd;
+    int      family;
+    uint32_t num_queued;
+
+    uint8_t             send_bufs[DHT_RAW_BATCH_SIZE][DHT_RAW_REQUEST_SIZE];
+    struct sockaddr_in6 send_addrs[DHT_RAW_BATCH_SIZE];
+    struct iovec        send_iov[DHT_RAW_BATCH_SIZE];
+    struct mmsghdr      send_msgs[DHT_RAW_BATCH_SIZE];
+
+    uint8_t             recv_bufs[DHT_RAW_BATCH_SIZE][DHT_RAW_RECV_SIZE];
+    struct iovec        recv_iov[DHT_RAW_BATCH_SIZE];
+    struct mmsghdr      recv_msgs[DHT_RAW_BATCH_SIZE];
+} DHT_Raw_Socket;
+
+typedef struct DHT_Raw_Key {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    bool    valid;
+} DHT_Raw_Key;
+
+struct DHT_Raw {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t ping_key[crypto_shorthash_KEYBYTES];
+
+    DHT_Raw_Socket *sockets;
+    uint16_t       num_sockets;
+    uint16_t       next_socket;
+
+    DHT_Raw_Key    *key_cache;   /* open addressing hash table */
+    uint32_t       key_cache_size;
+    uint32_t       key_cache_count;
+    uint64_t       key_seed;
+
+    dht_raw_response_cb *callback;
+    DHT_Raw_Stats  stats;
+};
+
+/* Returns the slot holding the shared key for public_key, or the empty slot where it would go. */
+static DHT_Raw_Key *dht_raw_find_key(DHT_Raw_Key *cache, uint32_t size, uint64_t seed, const uint8_t *public_key)
+{
+    uint64_t h;
+    memcpy(&h, public_key, sizeof(h));
+
+    /* Seeded so that nodes can't pick keys that all land on the same probe sequence */
+    uint32_t i = (uint32_t) (((h ^ seed) * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+
+    while (cache[i].valid && memcmp(cache[i].public_key, public_key, crypto_box_PUBLICKEYBYTES) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &cache[i];
+}
+
+/*
+ * Makes room for one more shared key. The cache doubles until it reaches its maximum size, and keys are
+ * moved, not recomputed. At maximum size, or if the larger cache can't be allocated, it is emptied
+ * instead, so there is always a free slot to probe for.
+ */
+static void dht_raw_grow_key_cache(DHT_Raw *dht)
+{
+    if (dht->key_cache_size < DHT_RAW_KEY_CACHE_MAX_SIZE) {
+        const uint32_t new_size = dht->key_cache_size * 2;
+        DHT_Raw_Key *cache = calloc(new_size, sizeof(DHT_Raw_Key));
+
+        if (cache != NULL) {
+            for (uint32_t i = 0; i < dht->key_cache_size; ++i) {
+                const DHT_Raw_Key *entry = &dht->key_cache[i];
+
+                if (entry->valid) {
+                    *dht_raw_find_key(cache, new_size, dht->key_seed, entry->public_key) = *entry;
+                }
+            }
+
+            free(dht->key_cache);
+            dht->key_cache = cache;
+            dht->key_cache_size = new_size;
+            return;
+        }
+    }
+
+    memset(dht->key_cache, 0, dht->key_cache_size * sizeof(DHT_Raw_Key));
+    dht->key_cache_count = 0;
+}
+
+/* Returns the shared key for public_key, computing and caching it if needed. Returns NULL if the key is invalid. */
+static const uint8_t *dht_raw_shared_key(DHT_Raw *dht, const uint8_t *public_key)
+{
+    DHT_Raw_Key *entry = dht_raw_find_key(dht->key_cache, dht->key_cache_size, dht->key_seed, public_key);
+
+    if (entry->valid) {
+        return entry->shared_key;
+    }
+
+    if (dht->key_cache_count >= dht->key_cache_size / 4 * 3) {
+        dht_raw_grow_key_cache(dht);
+        entry = dht_raw_find_key(dht->key_cache, dht->key_cache_size, dht->key_seed, public_key);
+    }
+
+    if (crypto_box_beforenm(entry->shared_key, public_key, dht->secret_key) != 0) {
+        return NULL;
+    }
+
+    memcpy(entry->public_key, public_key, crypto_box_PUBLICKEYBYTES);
+    entry->valid = true;
+    ++dht->key_cache_count;
+
+    return entry->shared_key;
+}
+
+/* Puts the sendback data for a request to public_key sent at time t in ping_id. */
+static void dht_raw_make_ping_id(const DHT_Raw *dht, const uint8_t *public_key, uint32_t t, uint8_t *ping_id)
+{
+    uint8_t msg[crypto_box_PUBLICKEYBYTES + sizeof(uint32_t)];
+    uint8_t hash[crypto_shorthash_BYTES];
+
+    memcpy(msg, public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(msg + crypto_box_PUBLICKEYBYTES, &t, sizeof(t));
+    crypto_shorthash(hash, msg, sizeof(msg), dht->ping_key);
+
+    memcpy(ping_id, &t, sizeof(t));
+    memcpy(ping_id + sizeof(t), hash, DHT_RAW_PING_ID_SIZE - sizeof(t));
+}
+
+/* Returns true if ping_id was made by us for a recent request to public_key. */
+static bool dht_raw_check_ping_id(const DHT_Raw *dht, const uint8_t *public_key, const uint8_t *ping_id)
+{
+    uint32_t t;
+    memcpy(&t, ping_id, sizeof(t));
+
+    const uint32_t now = (uint32_t) get_time();
+
+    if (t > now || now - t > DHT_RAW_RESPONSE_TIMEOUT) {
+        return false;
+    }
+
+    uint8_t expected[DHT_RAW_PING_ID_SIZE];
+    dht_raw_make_ping_id(dht, public_key, t, expected);
+
+    return sodium_memcmp(expected, ping_id, DHT_RAW_PING_ID_SIZE) == 0;
+}
+
+/* Sends the queued packets of sock. Packets that don't fit in the socket buffer are dropped. */
+static void dht_raw_flush(DHT_Raw *dht, DHT_Raw_Socket *sock)
+{
+    uint32_t sent = 0;   /* packets handed to the kernel or dropped */
+    uint32_t accepted = 0;
+
+    while (sent < sock->num_queued) {
+        const int ret = sendmmsg(sock->fd, &sock->send_msgs[sent], sock->num_queued - sent, 0);
+
+        if (ret > 0) {
+            sent += ret;
+            accepted += ret;
+            continue;
+        }
+
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        /* The first packet of the remaining batch failed. Skip it, since it may be the cause. */
+        ++dht->stats.requests_dropped;
+        ++sent;
+    }
+
+    dht->stats.requests_sent += accepted;
+    sock->num_queued = 0;
+}
+
+/* Puts the destination address of node in addr. Returns -1 if the socket can't reach its address family. */
+static int dht_raw_node_addr(const DHT_Raw_Socket *sock, const DHT_Node *node, struct sockaddr_in6 *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in6));
+
+    if (sock->family == AF_INET) {
+        if (node->family != NODE_IPV4) {
+            return -1;
+        }
+
+        struct sockaddr_in *addr4 = (struct sockaddr_in *) addr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(node->port);
+        memcpy(&addr4->sin_addr, node->ip, 4);
+
+        return 0;
+    }
+
+    addr->sin6_family = AF_INET6;
+    addr->sin6_port = htons(node->port);
+
+    if (node->family == NODE_IPV4) {
+        addr->sin6_addr.s6_addr[10] = 0xff;
+        addr->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&addr->sin6_addr.s6_addr[12], node->ip, 4);
+    } else {
+        memcpy(&addr->sin6_addr, node->ip, 16);
+    }
+
+    return 0;
+}
+
+bool dht_raw_get_nodes(DHT_Raw *dht, const DHT_Node *node, const uint8_t *target_key)
+{
+    DHT_Raw_Socket *sock = &dht->sockets[dht->next_socket];
+    const uint32_t i = sock->num_queued;
+
+    if (dht_raw_node_addr(sock, node, &sock->send_addrs[i]) != 0) {
+        return false;
+    }
+
+    const uint8_t *shared_key = dht_raw_shared_key(dht, node->public_key);
+
+    if (shared_key == NULL) {
+        return false;
+    }
+
+    uint8_t plain[DHT_RAW_REQUEST_PLAIN_SIZE];
+    memcpy(plain, target_key, crypto_box_PUBLICKEYBYTES);
+    dht_raw_make_ping_id(dht, node->public_key, (uint32_t) get_time(), plain + crypto_box_PUBLICKEYBYTES);
+
+    sodium_increment(dht->nonce, sizeof(dht->nonce));
+
+    uint8_t *packet = sock->send_bufs[i];
+    packet[0] = NET_PACKET_GET_NODES;
+    memcpy(packet + 1, dht->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, dht->nonce, crypto_box_NONCEBYTES);
+
+    if (crypto_box_easy_afternm(packet + DHT_RAW_HEADER_SIZE, plain, sizeof(plain), dht->nonce, shared_key) != 0) {
+        return false;
+    }
+
+    if (++sock->num_queued == DHT_RAW_BATCH_SIZE) {
+        dht_raw_flush(dht, sock);
+    }
+
+    dht->next_socket = (dht->next_socket + 1) % dht->num_sockets;
+
+    return true;
+}
+
+/*
+ * Unpacks one node from data into node.
+ *
+ * Returns the number of bytes used, or -1 if data does not start with a valid packed node.
+ * Nodes with TCP address families are unpacked but node->port is set to 0.
+ */
+static int dht_raw_unpack_node(const uint8_t *data, size_t len, DHT_Node *node)
+{
+    if (len < 1) {
+        return -1;
+    }
+
+    size_t ip_size;
+    bool tcp = false;
+
+    switch (data[0]) {
+        case DHT_RAW_TCP_AF_INET:
+            tcp = true;
+
+        /* fallthrough */
+        case DHT_RAW_AF_INET:
+            ip_size = 4;
+            node->family = NODE_IPV4;
+            break;
+
+        case DHT_RAW_TCP_AF_INET6:
+            tcp = true;
+
+        /* fallthrough */
+        case DHT_RAW_AF_INET6:
+            ip_size = 16;
+            node->family = NODE_IPV6;
+            break;
+
+        default:
+            return -1;
+    }
+
+    const size_t size = 1 + ip_size + sizeof(uint16_t) + crypto_box_PUBLICKEYBYTES;
+
+    if (len < size) {
+        return -1;
+    }
+
+    memset(node->ip, 0, sizeof(node->ip));
+    memcpy(node->ip, data + 1, ip_size);
+
+    uint16_t port;
+    memcpy(&port, data + 1 + ip_size, sizeof(port));
+    node->port = tcp ? 0 : ntohs(port);
+
+    memcpy(node->public_key, data + 1 + ip_size + sizeof(port), crypto_box_PUBLICKEYBYTES);
+
+    return size;
+}
+
+static void dht_raw_handle_packet(DHT_Raw *dht, const uint8_t *packet, size_t len, void *user_data)
+{
+    if (len < DHT_RAW_RESPONSE_MIN_SIZE || packet[0] != NET_PACKET_SEND_NODES_IPV6) {
+        return;
+    }
+
+    const uint8_t *sender_key = packet + 1;
+    const uint8_t *nonce = packet + 1 + crypto_box_PUBLICKEYBYTES;
+    const size_t cipher_len = len - DHT_RAW_HEADER_SIZE;
+    const size_t plain_len = cipher_len - crypto_box_MACBYTES;
+    uint8_t plain[DHT_RAW_RESPONSE_PLAIN_MAX_SIZE];
+
+    const uint8_t *shared_key = dht_raw_shared_key(dht, sender_key);
+
+    if (plain_len > sizeof(plain) || shared_key == NULL
+            || crypto_box_open_easy_afternm(plain, packet + DHT_RAW_HEADER_SIZE, cipher_len, nonce, shared_key) != 0
+            || plain[0] > DHT_RAW_MAX_SENT_NODES
+            || !dht_raw_check_ping_id(dht, sender_key, plain + plain_len - DHT_RAW_PING_ID_SIZE)) {
+        ++dht->stats.bad_packets;
+        return;
+    }
+
+    ++dht->stats.responses;
+
+    const size_t nodes_len = plain_len - 1 - DHT_RAW_PING_ID_SIZE;
+    size_t offset = 0;
+    bool reported = false;
+
+    for (uint8_t i = 0; i < plain[0]; ++i) {
+        DHT_Node node;
+        memset(&node, 0, sizeof(node));
+
+        const int size = dht_raw_unpack_node(plain + 1 + offset, nodes_len - offset, &node);
+
+        if (size == -1) {
+            ++dht->stats.bad_packets;
+            return;
+        }
+
+        offset += size;
+
+        if (node.port != 0) {
+            dht->callback(user_data, sender_key, &node);
+            reported = true;
+        }
+    }
+
+    if (!reported) {
+        dht->callback(user_data, sender_key, NULL);
+    }
+}
+
+static void dht_raw_receive(DHT_Raw *dht, DHT_Raw_Socket *sock, void *user_data)
+{
+    for (size_t b = 0; b < DHT_RAW_MAX_RECV_BATCHES; ++b) {
+        const int n = recvmmsg(sock->fd, sock->recv_msgs, DHT_RAW_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+        if (n <= 0) {
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            dht_raw_handle_packet(dht, sock->recv_bufs[i], sock->recv_msgs[i].msg_len, user_data);
+        }
+
+        if (n < DHT_RAW_BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+void dht_raw_iterate(DHT_Raw *dht, void *user_data)
+{
+    for (uint16_t i = 0; i < dht->num_sockets; ++i) {
+        dht_raw_flush(dht, &dht->sockets[i]);
+    }
+
+    for (uint16_t i = 0; i < dht->num_sockets; ++i) {
+        dht_raw_receive(dht, &dht->sockets[i], user_data);
+    }
+}
+
+uint32_t dht_raw_iteration_interval(const DHT_Raw *dht)
+{
+    return DHT_RAW_ITERATION_INTERVAL;
+}
+
+const uint8_t *dht_raw_public_key(const DHT_Raw *dht)
+{
+    return dht->public_key;
+}
+
+void dht_raw_get_stats(const DHT_Raw *dht, DHT_Raw_Stats *stats)
+{
+    *stats = dht->stats;
+}
+
+/*
+ * Opens a non-blocking UDP socket bound to an ephemeral port, dual stack if possible.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the socket cannot be created or bound.
+ */
+static int dht_raw_open_socket(DHT_Raw_Socket *sock)
+{
+    const int buf_size = DHT_RAW_SOCKET_BUF_SIZE;
+    const int off = 0;
+
+    sock->family = AF_INET6;
+    sock->fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock->fd != -1) {
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+
+        if (setsockopt(sock->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0
+                || bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(sock->fd);
+            sock->fd = -1;
+        }
+    }
+
+    if (sock->fd == -1) {
+        sock->family = AF_INET;
+        sock->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sock->fd == -1) {
+            return -1;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(sock->fd);
+            sock->fd = -1;
+            return -1;
+        }
+    }
+
+    /* Best effort; the kernel caps these at net.core.rmem_max and wmem_max */
+    setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+    const socklen_t addr_len = sock->family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+    for (size_t i = 0; i < DHT_RAW_BATCH_SIZE; ++i) {
+        sock->send_iov[i].iov_base = sock->send_bufs[i];
+        sock->send_iov[i].iov_len = DHT_RAW_REQUEST_SIZE;
+        sock->send_msgs[i].msg_hdr.msg_name = &sock->send_addrs[i];
+        sock->send_msgs[i].msg_hdr.msg_namelen = addr_len;
+        sock->send_msgs[i].msg_hdr.msg_iov = &sock->send_iov[i];
+        sock->send_msgs[i].msg_hdr.msg_iovlen = 1;
+
+        sock->recv_iov[i].iov_base = sock->recv_bufs[i];
+        sock->recv_iov[i].iov_len = DHT_RAW_RECV_SIZE;
+        sock->recv_msgs[i].msg_hdr.msg_iov = &sock->recv_iov[i];
+        sock->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+DHT_Raw *dht_raw_new(uint16_t num_sockets, dht_raw_response_cb *callback)
+{
+    if (num_sockets == 0 || sodium_init() == -1) {
+        return NULL;
+    }
+
+    DHT_Raw *dht = calloc(1, sizeof(DHT_Raw));
+
+    if (dht == NULL) {
+        return NULL;
+    }
+
+    dht->sockets = calloc(num_sockets, sizeof(DHT_Raw_Socket));
+    dht->key_cache = calloc(DHT_RAW_KEY_CACHE_MIN_SIZE, sizeof(DHT_Raw_Key));
+    dht->key_cache_size = DHT_RAW_KEY_CACHE_MIN_SIZE;
+
+    if (dht->sockets == NULL || dht->key_cache == NULL) {
+        free(dht->sockets);
+        free(dht->key_cache);
+        free(dht);
+        return NULL;
+    }
+
+    for (uint16_t i = 0; i < num_sockets; ++i) {
+        if (dht_raw_open_socket(&dht->sockets[i]) != 0) {
+            dht_raw_kill(dht);
+            return NULL;
+        }
+
+        ++dht->num_sockets;
+    }
+
+    crypto_box_keypair(dht->public_key, dht->secret_key);
+    randombytes_buf(dht->nonce, sizeof(dht->nonce));
+    randombytes_buf(&dht->key_seed, sizeof(dht->key_seed));
+    crypto_shorthash_keygen(dht->ping_key);
+    dht->callback = callback;
+
+    return dht;
+}
+
+void dht_raw_kill(DHT_Raw *dht)
+{
+    if (dht == NULL) {
+        return;
+    }
+
+    for (uint16_t i = 0; i < dht->num_sockets; ++i) {
+        close(dht->sockets[i].fd);
+    }
+
+    sodium_memzero(dht->secret_key, sizeof(dht->secret_key));
+    free(dht->sockets);
+    free(dht->key_cache);
+    free(dht);
+}
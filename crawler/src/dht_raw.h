@@ -0,0 +1,97 @@
+/*  dht_raw.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DHT_RAW_H
+#define DHT_RAW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nodes.h"
+
+/*
+ * A minimal Tox DHT client that only implements the getnodes request/response exchange.
+ *
+ * Requests are queued per socket and sent in batches with sendmmsg(), and responses are read in
+ * batches with recvmmsg(). No per-request state is kept: the sendback data of each request holds a
+ * timestamp and a keyed hash of the destination's public key, which is checked when the response
+ * arrives.
+ */
+
+/* Tox DHT packet ids and sizes */
+#define NET_PACKET_GET_NODES        2
+#define NET_PACKET_SEND_NODES_IPV6  4
+
+#define DHT_RAW_MAX_SENT_NODES      4
+#define DHT_RAW_PING_ID_SIZE        8
+
+/* Tox's on-the-wire address families for packed nodes */
+#define DHT_RAW_AF_INET         2
+#define DHT_RAW_AF_INET6        10
+#define DHT_RAW_TCP_AF_INET     130
+#define DHT_RAW_TCP_AF_INET6    138
+
+typedef struct DHT_Raw DHT_Raw;
+
+/*
+ * Called for each node in a getnodes response. responder_key is the public key of the node that
+ * sent the response. A valid response without any usable nodes is reported once with node set to
+ * NULL, so that the responder is still known to have answered.
+ */
+typedef void dht_raw_response_cb(void *user_data, const uint8_t *responder_key, const DHT_Node *node);
+
+typedef struct DHT_Raw_Stats {
+    uint64_t requests_sent;      /* accepted by the kernel */
+    uint64_t requests_dropped;   /* could not be sent because the socket buffer was full */
+    uint64_t responses;
+    uint64_t bad_packets;   /* packets that failed to decrypt, parse, or match a request */
+} DHT_Raw_Stats;
+
+/*
+ * Creates a client with a fresh DHT key pair and num_sockets UDP sockets bound to ephemeral ports.
+ * Sockets are dual stack if the host supports IPv6.
+ *
+ * Returns NULL on failure.
+ */
+DHT_Raw *dht_raw_new(uint16_t num_sockets, dht_raw_response_cb *callback);
+
+void dht_raw_kill(DHT_Raw *dht);
+
+/*
+ * Queues a getnodes request to node asking for the nodes closest to target_key. Queued requests are
+ * sent once a socket's batch is full or on the next call to dht_raw_iterate().
+ *
+ * Returns false if the request cannot be built or the node's address family is not supported.
+ */
+bool dht_raw_get_nodes(DHT_Raw *dht, const DHT_Node *node, const uint8_t *target_key);
+
+/* Sends all queued requests and handles all pending responses. */
+void dht_raw_iterate(DHT_Raw *dht, void *user_data);
+
+/* Returns the number of milliseconds to wait between calls to dht_raw_iterate(). */
+uint32_t dht_raw_iteration_interval(const DHT_Raw *dht);
+
+const uint8_t *dht_raw_public_key(const DHT_Raw *dht);
+
+void dht_raw_get_stats(const DHT_Raw *dht, DHT_Raw_Stats *stats);
+
+#endif  /* DHT_RAW_H */
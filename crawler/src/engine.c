@@ -0,0 +1,188 @@
+/*  engine.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tox/tox.h>
+#include "tox_private.h"
+
+#include "engine.h"
+#include "dht_raw.h"
+
+/* Number of UDP sockets used by a raw engine */
+#define ENGINE_RAW_SOCKETS 2
+
+struct Engine {
+    Engine_Type type;
+    Tox         *tox;
+    DHT_Raw     *raw;
+
+    engine_response_cb *callback;
+    void        *user_data;   /* passed to callback during engine_iterate() */
+};
+
+/* toxcore only gives us the IP as a string and doesn't say which node the response came from */
+static void engine_tox_response(Tox *tox, const uint8_t *public_key, const char *ip, uint16_t port, void *user_data)
+{
+    Engine *engine = (Engine *) user_data;
+
+    if (public_key == NULL || ip == NULL) {
+        return;
+    }
+
+    DHT_Node node;
+    memset(&node, 0, sizeof(node));
+
+    if (node_ip_parse(&node, ip) != 0) {
+        return;
+    }
+
+    memcpy(node.public_key, public_key, NODE_PUBLIC_KEY_SIZE);
+    node.port = port;
+
+    engine->callback(engine->user_data, NULL, &node);
+}
+
+Engine *engine_new(Engine_Type type, engine_response_cb *callback)
+{
+    Engine *engine = calloc(1, sizeof(Engine));
+
+    if (engine == NULL) {
+        return NULL;
+    }
+
+    engine->type = type;
+    engine->callback = callback;
+
+    if (type == ENGINE_RAW) {
+        engine->raw = dht_raw_new(ENGINE_RAW_SOCKETS, callback);
+
+        if (engine->raw == NULL) {
+            fprintf(stderr, "dht_raw_new() failed\n");
+            free(engine);
+            return NULL;
+        }
+
+        return engine;
+    }
+
+    struct Tox_Options options;
+    tox_options_default(&options);
+
+    TOX_ERR_NEW err;
+    engine->tox = tox_new(&options, &err);
+
+    if (err != TOX_ERR_NEW_OK || engine->tox == NULL) {
+        fprintf(stderr, "tox_new() failed: %d\n", err);
+        free(engine);
+        return NULL;
+    }
+
+    tox_callback_dht_get_nodes_response(engine->tox, engine_tox_response);
+
+    return engine;
+}
+
+void engine_kill(Engine *engine)
+{
+    if (engine == NULL) {
+        return;
+    }
+
+    if (engine->type == ENGINE_RAW) {
+        dht_raw_kill(engine->raw);
+    } else {
+        tox_kill(engine->tox);
+    }
+
+    free(engine);
+}
+
+Engine_Type engine_type(const Engine *engine)
+{
+    return engine->type;
+}
+
+void engine_iterate(Engine *engine, void *user_data)
+{
+    if (engine->type == ENGINE_RAW) {
+        dht_raw_iterate(engine->raw, user_data);
+        return;
+    }
+
+    engine->user_data = user_data;
+    tox_iterate(engine->tox, engine);
+}
+
+uint32_t engine_iteration_interval(const Engine *engine)
+{
+    if (engine->type == ENGINE_RAW) {
+        return dht_raw_iteration_interval(engine->raw);
+    }
+
+    return tox_iteration_interval(engine->tox);
+}
+
+bool engine_get_nodes(Engine *engine, const DHT_Node *node, const uint8_t *target_key)
+{
+    if (engine->type == ENGINE_RAW) {
+        return dht_raw_get_nodes(engine->raw, node, target_key);
+    }
+
+    char ip[NODE_IP_STRING_SIZE];
+    node_ip_string(node, ip, sizeof(ip));
+
+    return tox_dht_get_nodes(engine->tox, node->public_key, ip, node->port, target_key, NULL);
+}
+
+/*
+ * The raw engine has no routing table to bootstrap, so we ask the node for its own neighbourhood and
+ * for ours. The nodes it returns seed the crawl.
+ */
+int engine_bootstrap(Engine *engine, const char *ip, uint16_t port, const uint8_t *public_key)
+{
+    if (engine->type == ENGINE_TOX) {
+        TOX_ERR_BOOTSTRAP err;
+        tox_bootstrap(engine->tox, ip, port, public_key, &err);
+
+        return err == TOX_ERR_BOOTSTRAP_OK ? 0 : -1;
+    }
+
+    DHT_Node node;
+    memset(&node, 0, sizeof(node));
+
+    if (node_ip_parse(&node, ip) != 0) {
+        return -1;
+    }
+
+    memcpy(node.public_key, public_key, NODE_PUBLIC_KEY_SIZE);
+    node.port = port;
+
+    if (!dht_raw_get_nodes(engine->raw, &node, public_key)
+            || !dht_raw_get_nodes(engine->raw, &node, dht_raw_public_key(engine->raw))) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*  engine.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nodes.h"
+
+/*
+ * The DHT client a crawler sends its getnodes requests through.
+ *
+ * ENGINE_TOX runs a full toxcore instance. ENGINE_RAW speaks only the getnodes exchange over its own
+ * UDP sockets (see dht_raw.h), which is much cheaper per request and lets a crawler iterate faster.
+ */
+typedef enum Engine_Type {
+    ENGINE_TOX,
+    ENGINE_RAW,
+} Engine_Type;
+
+typedef struct Engine Engine;
+
+/*
+ * Called for each node in a getnodes response. responder_key is the public key of the node that
+ * sent the response, or NULL if the engine cannot tell. The raw engine also reports a valid response
+ * without any usable nodes, once, with node set to NULL.
+ */
+typedef void engine_response_cb(void *user_data, const uint8_t *responder_key, const DHT_Node *node);
+
+/* Returns NULL on failure. */
+Engine *engine_new(Engine_Type type, engine_response_cb *callback);
+
+void engine_kill(Engine *engine);
+
+Engine_Type engine_type(const Engine *engine);
+
+/* Sends pending requests and handles responses. user_data is passed to the response callback. */
+void engine_iterate(Engine *engine, void *user_data);
+
+/* Returns the number of milliseconds to wait between calls to engine_iterate(). */
+uint32_t engine_iteration_interval(const Engine *engine);
+
+/*
+ * Asks node for the nodes closest to target_key.
+ *
+ * Returns false if the request cannot be sent.
+ */
+bool engine_get_nodes(Engine *engine, const DHT_Node *node, const uint8_t *target_key);
+
+/*
+ * Bootstraps to the node at ip:port with the given public key.
+ *
+ * Returns 0 on success.
+ * Returns -1 if ip is invalid or the request cannot be sent.
+ */
+int engine_bootstrap(Engine *engine, const char *ip, uint16_t port, const uint8_t *public_key);
+
+#endif  /* ENGINE_H */
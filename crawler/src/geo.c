@@ -0,0 +1,1124 @@
+/*  geo.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "geo.h"
+
+/*
+ * Database layout
+ *
+ * Every address is treated as a 128 bit key; IPv4 addresses occupy the top 32 bits. The top
+ * GEO_DIRECT_BITS bits of a key index a direct table whose entries are either a leaf (a record id with
+ * GEO_DIRECT_LEAF set) or the index of a poptrie node. Each node consumes the next GEO_STRIDE bits.
+ * Its internal children are stored contiguously starting at base0, and its leaves are stored run
+ * length compressed starting at base1: bit i of leafvec is set if slot i is a leaf whose value
+ * differs from the previous leaf in the node.
+ *
+ * All integers are stored in the byte order of the host that compiled the database.
+ */
+#define GEO_DB_MAGIC     "TCGEODB1"
+#define GEO_BYTE_ORDER   0x01020304
+#define GEO_DIRECT_BITS  16
+#define GEO_DIRECT_SIZE  (1 << GEO_DIRECT_BITS)
+#define GEO_DIRECT_LEAF  0x80000000
+#define GEO_STRIDE       6
+#define GEO_KEY_BITS     128
+
+#define GEO_FILE_EXT  ".geo"
+#define AGG_FILE_EXT  ".agg"
+#define LOG_FILE_EXT  ".cwl"
+#define TEMP_FILE_EXT ".tmp"
+
+/* Max number of characters in an IP address string */
+#define GEO_IP_STRING_SIZE 96
+
+enum {
+    GEO_IPV4,
+    GEO_IPV6,
+    GEO_NUM_FAMILIES,
+};
+
+typedef unsigned __int128 geo_key;
+
+typedef struct Geo_Node {
+    uint64_t vector;
+    uint64_t leafvec;
+    uint32_t base0;
+    uint32_t base1;
+} Geo_Node;
+
+typedef struct Geo_DB_Header {
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t num_records;
+    uint32_t num_nodes[GEO_NUM_FAMILIES];
+    uint32_t num_leaves[GEO_NUM_FAMILIES];
+    uint64_t records_offset;
+    uint64_t direct_offset[GEO_NUM_FAMILIES];
+    uint64_t nodes_offset[GEO_NUM_FAMILIES];
+    uint64_t leaves_offset[GEO_NUM_FAMILIES];
+} Geo_DB_Header;
+
+typedef struct Geo_Trie {
+    const uint32_t *direct;
+    const Geo_Node *nodes;
+    const uint32_t *leaves;
+    uint32_t       num_nodes;
+    uint32_t       num_leaves;
+} Geo_Trie;
+
+struct Geo_DB {
+    void             *map;
+    size_t           map_size;
+    const Geo_Record *records;   /* records[0] is unused so that record ids can index it directly */
+    uint32_t         num_records;
+    Geo_Trie         trie[GEO_NUM_FAMILIES];
+};
+
+/*
+ * Lookups
+ */
+static uint32_t geo_slot(geo_key key, uint32_t pos)
+{
+    if (pos + GEO_STRIDE <= GEO_KEY_BITS) {
+        return (uint32_t) (key >> (GEO_KEY_BITS - GEO_STRIDE - pos)) & ((1 << GEO_STRIDE) - 1);
+    }
+
+    return (uint32_t) (key << (pos - (GEO_KEY_BITS - GEO_STRIDE))) & ((1 << GEO_STRIDE) - 1);
+}
+
+/* Returns the record id for key. */
+static uint32_t geo_lookup_key(const Geo_Trie *trie, geo_key key)
+{
+    const uint32_t entry = trie->direct[(uint32_t) (key >> (GEO_KEY_BITS - GEO_DIRECT_BITS))];
+
+    if (entry & GEO_DIRECT_LEAF) {
+        return entry & ~GEO_DIRECT_LEAF;
+    }
+
+    const Geo_Node *node = &trie->nodes[entry];
+
+    for (uint32_t pos = GEO_DIRECT_BITS; pos < GEO_KEY_BITS; pos += GEO_STRIDE) {
+        const uint64_t bit = 1ULL << geo_slot(key, pos);
+        const uint64_t mask = (bit << 1) - 1;
+
+        if (!(node->vector & bit)) {
+            return trie->leaves[node->base1 + __builtin_popcountll(node->leafvec & mask) - 1];
+        }
+
+        node = &trie->nodes[node->base0 + __builtin_popcountll(node->vector & mask) - 1];
+    }
+
+    return 0;
+}
+
+uint32_t geo_lookup_ipv4(const Geo_DB *db, uint32_t addr)
+{
+    const Geo_Trie *trie = &db->trie[GEO_IPV4];
+    const uint32_t entry = trie->direct[addr >> (32 - GEO_DIRECT_BITS)];
+
+    if (entry & GEO_DIRECT_LEAF) {
+        return entry & ~GEO_DIRECT_LEAF;
+    }
+
+    const Geo_Node *node = &trie->nodes[entry];
+
+    for (uint32_t pos = GEO_DIRECT_BITS; pos < 32; pos += GEO_STRIDE) {
+        const uint32_t slot = pos + GEO_STRIDE <= 32 ? addr >> (32 - GEO_STRIDE - pos) : addr << (pos - (32 - GEO_STRIDE));
+        const uint64_t bit = 1ULL << (slot & ((1 << GEO_STRIDE) - 1));
+        const uint64_t mask = (bit << 1) - 1;
+
+        if (!(node->vector & bit)) {
+            return trie->leaves[node->base1 + __builtin_popcountll(node->leafvec & mask) - 1];
+        }
+
+        node = &trie->nodes[node->base0 + __builtin_popcountll(node->vector & mask) - 1];
+    }
+
+    return 0;
+}
+
+static geo_key geo_key_from_bytes(const uint8_t *bytes, size_t len)
+{
+    geo_key key = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        key = (key << 8) | bytes[i];
+    }
+
+    return key << (GEO_KEY_BITS - len * 8);
+}
+
+uint32_t geo_lookup_ipv6(const Geo_DB *db, const uint8_t *addr)
+{
+    return geo_lookup_key(&db->trie[GEO_IPV6], geo_key_from_bytes(addr, 16));
+}
+
+uint32_t geo_lookup(const Geo_DB *db, const char *ip)
+{
+    struct in_addr addr4;
+
+    if (inet_pton(AF_INET, ip, &addr4) == 1) {
+        return geo_lookup_ipv4(db, ntohl(addr4.s_addr));
+    }
+
+    struct in6_addr addr6;
+
+    if (inet_pton(AF_INET6, ip, &addr6) != 1) {
+        return 0;
+    }
+
+    if (IN6_IS_ADDR_V4MAPPED(&addr6)) {
+        uint32_t a;
+        memcpy(&a, &addr6.s6_addr[12], sizeof(a));
+        return geo_lookup_ipv4(db, ntohl(a));
+    }
+
+    return geo_lookup_ipv6(db, addr6.s6_addr);
+}
+
+const Geo_Record *geo_get_record(const Geo_DB *db, uint32_t id)
+{
+    if (id == 0 || id > db->num_records) {
+        return NULL;
+    }
+
+    return &db->records[id];
+}
+
+/*
+ * Loading
+ */
+static bool geo_section_ok(const Geo_DB *db, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset % 8 == 0 && offset <= db->map_size && count <= (db->map_size - offset) / size;
+}
+
+/* Checks that every index in the trie is in bounds and that children always come after their parent. */
+static bool geo_trie_ok(const Geo_Trie *trie, uint32_t num_records)
+{
+    for (uint32_t i = 0; i < GEO_DIRECT_SIZE; ++i) {
+        const uint32_t entry = trie->direct[i];
+
+        if (entry & GEO_DIRECT_LEAF ? (entry & ~GEO_DIRECT_LEAF) > num_records : entry >= trie->num_nodes) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < trie->num_nodes; ++i) {
+        const Geo_Node *node = &trie->nodes[i];
+        const uint64_t leaves = ~node->vector;
+
+        if (node->vector != 0 && (node->base0 <= i
+                                  || node->base0 + (uint64_t) __builtin_popcountll(node->vector) > trie->num_nodes)) {
+            return false;
+        }
+
+        if (leaves != 0 && (!(node->leafvec & leaves & -leaves)
+                            || node->base1 + (uint64_t) __builtin_popcountll(node->leafvec) > trie->num_leaves)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < trie->num_leaves; ++i) {
+        if (trie->leaves[i] > num_records) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Geo_DB *geo_db_load(const char *path)
+{
+    Geo_DB *db = calloc(1, sizeof(Geo_DB));
+
+    if (db == NULL) {
+        return NULL;
+    }
+
+    const int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        free(db);
+        return NULL;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(Geo_DB_Header)) {
+        close(fd);
+        free(db);
+        return NULL;
+    }
+
+    db->map_size = st.st_size;
+    db->map = mmap(NULL, db->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (db->map == MAP_FAILED) {
+        free(db);
+        return NULL;
+    }
+
+    madvise(db->map, db->map_size, MADV_WILLNEED);
+
+    const uint8_t *base = db->map;
+    const Geo_DB_Header *hdr = db->map;
+
+    if (memcmp(hdr->magic, GEO_DB_MAGIC, sizeof(hdr->magic)) != 0 || hdr->byte_order != GEO_BYTE_ORDER
+            || !geo_section_ok(db, hdr->records_offset, (uint64_t) hdr->num_records + 1, sizeof(Geo_Record))) {
+        geo_db_free(db);
+        return NULL;
+    }
+
+    db->records = (const Geo_Record *) (base + hdr->records_offset);
+    db->num_records = hdr->num_records;
+
+    for (int f = 0; f < GEO_NUM_FAMILIES; ++f) {
+        Geo_Trie *trie = &db->trie[f];
+
+        if (!geo_section_ok(db, hdr->direct_offset[f], GEO_DIRECT_SIZE, sizeof(uint32_t))
+                || !geo_section_ok(db, hdr->nodes_offset[f], hdr->num_nodes[f], sizeof(Geo_Node))
+                || !geo_section_ok(db, hdr->leaves_offset[f], hdr->num_leaves[f], sizeof(uint32_t))) {
+            geo_db_free(db);
+            return NULL;
+        }
+
+        trie->direct = (const uint32_t *) (base + hdr->direct_offset[f]);
+        trie->nodes = (const Geo_Node *) (base + hdr->nodes_offset[f]);
+        trie->leaves = (const uint32_t *) (base + hdr->leaves_offset[f]);
+        trie->num_nodes = hdr->num_nodes[f];
+        trie->num_leaves = hdr->num_leaves[f];
+
+        if (!geo_trie_ok(trie, db->num_records)) {
+            geo_db_free(db);
+            return NULL;
+        }
+    }
+
+    return db;
+}
+
+void geo_db_free(Geo_DB *db)
+{
+    if (db == NULL) {
+        return;
+    }
+
+    munmap(db->map, db->map_size);
+    free(db);
+}
+
+/*
+ * Compiling
+ */
+typedef struct Geo_Range {
+    geo_key  start;
+    geo_key  end;
+    uint32_t value;
+} Geo_Range;
+
+typedef struct Geo_Builder {
+    Geo_Range  *ranges[GEO_NUM_FAMILIES];
+    size_t     num_ranges[GEO_NUM_FAMILIES];
+    size_t     ranges_size[GEO_NUM_FAMILIES];
+
+    Geo_Record *records;   /* records[0] is unused */
+    uint32_t   num_records;
+    uint32_t   records_size;
+    uint32_t   *record_table;   /* open addressing hash table of record ids */
+    uint32_t   record_table_size;
+
+    /* The trie that is currently being built */
+    uint32_t   direct[GEO_DIRECT_SIZE];
+    Geo_Node   *nodes;
+    uint32_t   num_nodes;
+    uint32_t   nodes_size;
+    uint32_t   *leaves;
+    uint32_t   num_leaves;
+    uint32_t   leaves_size;
+} Geo_Builder;
+
+/* Grows a builder array so that it can hold at least count + extra elements. */
+static int geo_grow(void **array, uint32_t *size, size_t elem_size, uint64_t count, uint32_t extra)
+{
+    if (count + extra <= *size) {
+        return 0;
+    }
+
+    uint64_t new_size = *size ? *size : 1024;
+
+    while (new_size < count + extra) {
+        new_size *= 2;
+    }
+
+    if (new_size > UINT32_MAX) {
+        return -1;
+    }
+
+    void *tmp = realloc(*array, new_size * elem_size);
+
+    if (tmp == NULL) {
+        return -1;
+    }
+
+    *array = tmp;
+    *size = new_size;
+
+    return 0;
+}
+
+static uint32_t geo_record_hash(uint32_t asn, const char *country)
+{
+    uint32_t h = asn * 2654435761U;
+    return h ^ ((uint32_t) (uint8_t) country[0] << 8 | (uint8_t) country[1]) * 40503U;
+}
+
+/*
+ * Returns the id of the record for asn and country, adding it if needed.
+ * Returns 0 on allocation failure.
+ */
+static uint32_t geo_add_record(Geo_Builder *b, uint32_t asn, const char *country)
+{
+    if ((uint64_t) (b->num_records + 1) * 2 > b->record_table_size) {
+        const uint32_t new_size = b->record_table_size ? b->record_table_size * 2 : 4096;
+        uint32_t *table = calloc(new_size, sizeof(uint32_t));
+
+        if (table == NULL) {
+            return 0;
+        }
+
+        for (uint32_t id = 1; id <= b->num_records; ++id) {
+            uint32_t i = geo_record_hash(b->records[id].asn, b->records[id].country) & (new_size - 1);
+
+            while (table[i] != 0) {
+                i = (i + 1) & (new_size - 1);
+            }
+
+            table[i] = id;
+        }
+
+        free(b->record_table);
+        b->record_table = table;
+        b->record_table_size = new_size;
+    }
+
+    uint32_t i = geo_record_hash(asn, country) & (b->record_table_size - 1);
+
+    while (b->record_table[i] != 0) {
+        const Geo_Record *rec = &b->records[b->record_table[i]];
+
+        if (rec->asn == asn && memcmp(rec->country, country, sizeof(rec->country)) == 0) {
+            return b->record_table[i];
+        }
+
+        i = (i + 1) & (b->record_table_size - 1);
+    }
+
+    if (geo_grow((void **) &b->records, &b->records_size, sizeof(Geo_Record), b->num_records + 1, 1) != 0) {
+        return 0;
+    }
+
+    const uint32_t id = ++b->num_records;
+    Geo_Record *rec = &b->records[id];
+    rec->asn = asn;
+    memcpy(rec->country, country, sizeof(rec->country));
+    rec->reserved = 0;
+
+    b->record_table[i] = id;
+
+    return id;
+}
+
+static int geo_add_range(Geo_Builder *b, int family, geo_key start, geo_key end, uint32_t value)
+{
+    uint32_t size = b->ranges_size[family];
+
+    if (geo_grow((void **) &b->ranges[family], &size, sizeof(Geo_Range), b->num_ranges[family], 1) != 0) {
+        return -1;
+    }
+
+    b->ranges_size[family] = size;
+    b->ranges[family][b->num_ranges[family]++] = (Geo_Range) {
+        start, end, value
+    };
+
+    return 0;
+}
+
+static int geo_cmp_range(const void *a, const void *b)
+{
+    const Geo_Range *x = a;
+    const Geo_Range *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Sorts the ranges, clips overlaps and merges adjacent ranges that map to the same record. */
+static void geo_normalize_ranges(Geo_Range *ranges, size_t *num_ranges)
+{
+    qsort(ranges, *num_ranges, sizeof(Geo_Range), geo_cmp_range);
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < *num_ranges; ++i) {
+        Geo_Range r = ranges[i];
+
+        if (n > 0) {
+            Geo_Range *prev = &ranges[n - 1];
+
+            if (r.end <= prev->end) {
+                continue;
+            }
+
+            if (r.start <= prev->end) {
+                r.start = prev->end + 1;
+            }
+
+            if (r.value == prev->value && r.start == prev->end + 1) {
+                prev->end = r.end;
+                continue;
+            }
+        }
+
+        ranges[n++] = r;
+    }
+
+    *num_ranges = n;
+}
+
+/* Returns the index of the first range that ends at or after key. ranges must be normalized. */
+static size_t geo_first_range(const Geo_Range *ranges, size_t num_ranges, geo_key key)
+{
+    size_t l = 0;
+    size_t r = num_ranges;
+
+    while (l < r) {
+        const size_t m = l + (r - l) / 2;
+
+        if (ranges[m].end < key) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+/*
+ * Returns true if every address in [lo, hi] maps to the same record, and puts it in value.
+ * ranges must be normalized.
+ */
+static bool geo_region_uniform(const Geo_Range *ranges, size_t num_ranges, geo_key lo, geo_key hi, uint32_t *value)
+{
+    const size_t l = geo_first_range(ranges, num_ranges, lo);
+
+    if (l == num_ranges || ranges[l].start > hi) {
+        *value = 0;
+        return true;
+    }
+
+    if (ranges[l].start <= lo && ranges[l].end >= hi) {
+        *value = ranges[l].value;
+        return true;
+    }
+
+    return false;
+}
+
+/* Builds the node at index idx covering the keys starting at lo whose first pos bits are fixed. */
+static int geo_build_node(Geo_Builder *b, const Geo_Range *ranges, size_t num_ranges, uint32_t idx, geo_key lo,
+                          uint32_t pos)
+{
+    uint32_t values[1 << GEO_STRIDE];
+    uint64_t vector = 0;
+    uint64_t leafvec = 0;
+    uint32_t num_children = 0;
+    uint32_t num_leaves = 0;
+    bool have_leaf = false;
+    uint32_t prev = 0;
+
+    /* Only the ranges that overlap this node matter to it and its children */
+    const geo_key hi = lo + (((geo_key) 1 << (GEO_KEY_BITS - pos)) - 1);
+    const size_t first = geo_first_range(ranges, num_ranges, lo);
+    size_t last = first + geo_first_range(ranges + first, num_ranges - first, hi);
+
+    if (last < num_ranges && ranges[last].start <= hi) {
+        ++last;
+    }
+
+    ranges += first;
+    num_ranges = last - first;
+
+    for (uint32_t i = 0; i < (1 << GEO_STRIDE); ++i) {
+        geo_key sub_lo;
+        geo_key sub_hi;
+
+        if (pos + GEO_STRIDE <= GEO_KEY_BITS) {
+            const uint32_t shift = GEO_KEY_BITS - GEO_STRIDE - pos;
+            sub_lo = lo + ((geo_key) i << shift);
+            sub_hi = sub_lo + (((geo_key) 1 << shift) - 1);
+        } else {
+            /* The last node of a full length key uses fewer than GEO_STRIDE bits; see geo_slot() */
+            const uint32_t shift = pos + GEO_STRIDE - GEO_KEY_BITS;
+
+            if (i & ((1 << shift) - 1)) {
+                values[i] = prev;
+                continue;
+            }
+
+            sub_lo = sub_hi = lo + (i >> shift);
+        }
+
+        uint32_t value;
+
+        if (!geo_region_uniform(ranges, num_ranges, sub_lo, sub_hi, &value)) {
+            vector |= 1ULL << i;
+            ++num_children;
+            continue;
+        }
+
+        values[i] = value;
+
+        if (!have_leaf || value != prev) {
+            leafvec |= 1ULL << i;
+            ++num_leaves;
+        }
+
+        have_leaf = true;
+        prev = value;
+    }
+
+    if (geo_grow((void **) &b->leaves, &b->leaves_size, sizeof(uint32_t), b->num_leaves, num_leaves) != 0
+            || geo_grow((void **) &b->nodes, &b->nodes_size, sizeof(Geo_Node), b->num_nodes, num_children) != 0) {
+        return -1;
+    }
+
+    Geo_Node *node = &b->nodes[idx];
+    node->vector = vector;
+    node->leafvec = leafvec;
+    node->base0 = b->num_nodes;
+    node->base1 = b->num_leaves;
+
+    for (uint32_t i = 0; i < (1 << GEO_STRIDE); ++i) {
+        if (leafvec & (1ULL << i)) {
+            b->leaves[b->num_leaves++] = values[i];
+        }
+    }
+
+    const uint32_t base0 = b->num_nodes;
+    b->num_nodes += num_children;
+
+    for (uint32_t i = 0, c = 0; i < (1 << GEO_STRIDE); ++i) {
+        if (!(vector & (1ULL << i))) {
+            continue;
+        }
+
+        const geo_key child_lo = lo + ((geo_key) i << (GEO_KEY_BITS - GEO_STRIDE - pos));
+
+        if (geo_build_node(b, ranges, num_ranges, base0 + c++, child_lo, pos + GEO_STRIDE) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int geo_build_trie(Geo_Builder *b, const Geo_Range *ranges, size_t num_ranges)
+{
+    b->num_nodes = 0;
+    b->num_leaves = 0;
+
+    for (uint32_t i = 0; i < GEO_DIRECT_SIZE; ++i) {
+        const geo_key lo = (geo_key) i << (GEO_KEY_BITS - GEO_DIRECT_BITS);
+        const geo_key hi = lo + (((geo_key) 1 << (GEO_KEY_BITS - GEO_DIRECT_BITS)) - 1);
+        uint32_t value;
+
+        if (geo_region_uniform(ranges, num_ranges, lo, hi, &value)) {
+            b->direct[i] = value | GEO_DIRECT_LEAF;
+            continue;
+        }
+
+        if (geo_grow((void **) &b->nodes, &b->nodes_size, sizeof(Geo_Node), b->num_nodes, 1) != 0) {
+            return -1;
+        }
+
+        b->direct[i] = b->num_nodes++;
+
+        if (geo_build_node(b, ranges, num_ranges, b->direct[i], lo, GEO_DIRECT_BITS) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Writes len bytes to fp followed by padding up to a multiple of 8 bytes, and advances offset. */
+static int geo_write_section(FILE *fp, const void *data, size_t len, uint64_t *offset)
+{
+    static const uint8_t padding[8];
+    const size_t pad = (8 - len % 8) % 8;
+
+    if ((len && fwrite(data, len, 1, fp) != 1) || (pad && fwrite(padding, pad, 1, fp) != 1)) {
+        return -1;
+    }
+
+    *offset += len + pad;
+
+    return 0;
+}
+
+/* Parses an address into a key. Returns the address family, or -1 if it is not a valid address. */
+static int geo_parse_key(const char *ip, geo_key *key)
+{
+    uint8_t addr[16];
+
+    if (inet_pton(AF_INET, ip, addr) == 1) {
+        *key = geo_key_from_bytes(addr, 4);
+        return GEO_IPV4;
+    }
+
+    if (inet_pton(AF_INET6, ip, addr) == 1) {
+        *key = geo_key_from_bytes(addr, 16);
+        return GEO_IPV6;
+    }
+
+    return -1;
+}
+
+static int geo_read_ranges(Geo_Builder *b, const char *in_path)
+{
+    FILE *fp = fopen(in_path, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[1024];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char start_str[GEO_IP_STRING_SIZE];
+        char end_str[GEO_IP_STRING_SIZE];
+        char country[8];
+        unsigned int asn;
+
+        if (line[0] == '#' || sscanf(line, "%95s %95s %u %7s", start_str, end_str, &asn, country) != 4 || asn == 0) {
+            continue;
+        }
+
+        geo_key start;
+        geo_key end;
+        const int family = geo_parse_key(start_str, &start);
+
+        if (family == -1 || geo_parse_key(end_str, &end) != family || end < start) {
+            continue;
+        }
+
+        /* IPv4 keys only use the top 32 bits, so the range has to cover the unused low bits too */
+        if (family == GEO_IPV4) {
+            end |= ((geo_key) 1 << (GEO_KEY_BITS - 32)) - 1;
+        }
+
+        if (strlen(country) != 2) {
+            strcpy(country, "--");
+        }
+
+        const uint32_t id = geo_add_record(b, asn, country);
+
+        if (id == 0 || geo_add_range(b, family, start, end, id) != 0) {
+            fclose(fp);
+            return -2;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+static void geo_builder_free(Geo_Builder *b)
+{
+    for (int f = 0; f < GEO_NUM_FAMILIES; ++f) {
+        free(b->ranges[f]);
+    }
+
+    free(b->records);
+    free(b->record_table);
+    free(b->nodes);
+    free(b->leaves);
+    free(b);
+}
+
+int geo_db_compile(const char *in_path, const char *out_path)
+{
+    Geo_Builder *b = calloc(1, sizeof(Geo_Builder));
+
+    if (b == NULL) {
+        return -2;
+    }
+
+    /* Make sure records[0] exists even if the input is empty */
+    if (geo_grow((void **) &b->records, &b->records_size, sizeof(Geo_Record), 0, 1) != 0) {
+        geo_builder_free(b);
+        return -2;
+    }
+
+    memset(&b->records[0], 0, sizeof(Geo_Record));
+
+    int ret = geo_read_ranges(b, in_path);
+
+    if (ret != 0) {
+        geo_builder_free(b);
+        return ret;
+    }
+
+    char temp_path[strlen(out_path) + strlen(TEMP_FILE_EXT) + 1];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", out_path, TEMP_FILE_EXT);
+
+    FILE *fp = fopen(temp_path, "w");
+
+    if (fp == NULL) {
+        geo_builder_free(b);
+        return -3;
+    }
+
+    /* The header is rewritten with the final offsets once all sections are written */
+    Geo_DB_Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, GEO_DB_MAGIC, sizeof(hdr.magic));
+    hdr.byte_order = GEO_BYTE_ORDER;
+    hdr.num_records = b->num_records;
+
+    uint64_t offset = 0;
+    ret = geo_write_section(fp, &hdr, sizeof(hdr), &offset);
+
+    hdr.records_offset = offset;
+    ret = ret ? ret : geo_write_section(fp, b->records, (b->num_records + 1) * sizeof(Geo_Record), &offset);
+
+    for (int f = 0; f < GEO_NUM_FAMILIES && ret == 0; ++f) {
+        geo_normalize_ranges(b->ranges[f], &b->num_ranges[f]);
+
+        if (geo_build_trie(b, b->ranges[f], b->num_ranges[f]) != 0) {
+            fclose(fp);
+            remove(temp_path);
+            geo_builder_free(b);
+            return -2;
+        }
+
+        hdr.num_nodes[f] = b->num_nodes;
+        hdr.num_leaves[f] = b->num_leaves;
+
+        hdr.direct_offset[f] = offset;
+        ret = geo_write_section(fp, b->direct, sizeof(b->direct), &offset);
+
+        hdr.nodes_offset[f] = offset;
+        ret = ret ? ret : geo_write_section(fp, b->nodes, b->num_nodes * sizeof(Geo_Node), &offset);
+
+        hdr.leaves_offset[f] = offset;
+        ret = ret ? ret : geo_write_section(fp, b->leaves, b->num_leaves * sizeof(uint32_t), &offset);
+    }
+
+    geo_builder_free(b);
+
+    if (ret != 0 || fseek(fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        fclose(fp);
+        remove(temp_path);
+        return -3;
+    }
+
+    if (fclose(fp) != 0 || rename(temp_path, out_path) != 0) {
+        remove(temp_path);
+        return -3;
+    }
+
+    return 0;
+}
+
+/*
+ * Enrichment
+ */
+#define GEO_NUM_COUNTRIES (26 * 26 + 1)   /* the last entry counts unknown countries */
+
+typedef struct Geo_Count {
+    uint32_t key;
+    uint32_t count;
+} Geo_Count;
+
+static int geo_cmp_count_key(const void *a, const void *b)
+{
+    const Geo_Count *x = a;
+    const Geo_Count *y = b;
+
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* Sorts by descending count, then ascending key. */
+static int geo_cmp_count(const void *a, const void *b)
+{
+    const Geo_Count *x = a;
+    const Geo_Count *y = b;
+
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+
+    return geo_cmp_count_key(a, b);
+}
+
+static uint32_t geo_country_index(const char *country)
+{
+    if (country[0] < 'A' || country[0] > 'Z' || country[1] < 'A' || country[1] > 'Z') {
+        return GEO_NUM_COUNTRIES - 1;
+    }
+
+    return (country[0] - 'A') * 26 + (country[1] - 'A');
+}
+
+/* Writes per-country and per-ASN node counts from the per-record counts. */
+static int geo_write_aggregates(const Geo_DB *db, const uint32_t *record_counts, uint32_t total, FILE *fp)
+{
+    Geo_Count *countries = calloc(GEO_NUM_COUNTRIES, sizeof(Geo_Count));
+    Geo_Count *asns = calloc(db->num_records + 1, sizeof(Geo_Count));
+
+    if (countries == NULL || asns == NULL) {
+        free(countries);
+        free(asns);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < GEO_NUM_COUNTRIES; ++i) {
+        countries[i].key = i;
+    }
+
+    size_t num_asns = 0;
+
+    for (uint32_t id = 1; id <= db->num_records; ++id) {
+        if (record_counts[id] == 0) {
+            continue;
+        }
+
+        const Geo_Record *rec = &db->records[id];
+        countries[geo_country_index(rec->country)].count += record_counts[id];
+        asns[num_asns++] = (Geo_Count) {
+            rec->asn, record_counts[id]
+        };
+    }
+
+    /* A single ASN can appear in several records, one per country */
+    qsort(asns, num_asns, sizeof(Geo_Count), geo_cmp_count_key);
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < num_asns; ++i) {
+        if (n > 0 && asns[n - 1].key == asns[i].key) {
+            asns[n - 1].count += asns[i].count;
+        } else {
+            asns[n++] = asns[i];
+        }
+    }
+
+    num_asns = n;
+
+    qsort(countries, GEO_NUM_COUNTRIES, sizeof(Geo_Count), geo_cmp_count);
+    qsort(asns, num_asns, sizeof(Geo_Count), geo_cmp_count);
+
+    fprintf(fp, "total %u\n", total);
+    fprintf(fp, "unknown %u\n", record_counts[0]);
+
+    for (uint32_t i = 0; i < GEO_NUM_COUNTRIES && countries[i].count > 0; ++i) {
+        if (countries[i].key == GEO_NUM_COUNTRIES - 1) {
+            fprintf(fp, "country -- %u\n", countries[i].count);
+        } else {
+            fprintf(fp, "country %c%c %u\n", 'A' + countries[i].key / 26, 'A' + countries[i].key % 26,
+                    countries[i].count);
+        }
+    }
+
+    for (size_t i = 0; i < num_asns; ++i) {
+        fprintf(fp, "asn %u %u\n", asns[i].key, asns[i].count);
+    }
+
+    free(countries);
+    free(asns);
+
+    return 0;
+}
+
+/* Renames path.tmp to path. */
+static int geo_commit_file(const char *path)
+{
+    char temp_path[strlen(path) + strlen(TEMP_FILE_EXT) + 1];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", path, TEMP_FILE_EXT);
+
+    return rename(temp_path, path) == 0 ? 0 : -3;
+}
+
+static FILE *geo_open_temp(const char *path)
+{
+    char temp_path[strlen(path) + strlen(TEMP_FILE_EXT) + 1];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", path, TEMP_FILE_EXT);
+
+    return fopen(temp_path, "w");
+}
+
+int geo_enrich(const Geo_DB *db, const char *base_path, geo_ip_cb *get_ip, void *user_data, uint32_t num_ips)
+{
+    uint32_t *record_counts = calloc(db->num_records + 1, sizeof(uint32_t));
+
+    if (record_counts == NULL) {
+        return -1;
+    }
+
+    char geo_path[strlen(base_path) + strlen(GEO_FILE_EXT) + 1];
+    char agg_path[strlen(base_path) + strlen(AGG_FILE_EXT) + 1];
+    snprintf(geo_path, sizeof(geo_path), "%s%s", base_path, GEO_FILE_EXT);
+    snprintf(agg_path, sizeof(agg_path), "%s%s", base_path, AGG_FILE_EXT);
+
+    FILE *fp = geo_open_temp(geo_path);
+
+    if (fp == NULL) {
+        free(record_counts);
+        return -2;
+    }
+
+    char buf[GEO_IP_STRING_SIZE];
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < num_ips; ++i) {
+        const char *ip = get_ip(user_data, i, buf, sizeof(buf));
+
+        if (ip == NULL) {
+            continue;
+        }
+
+        const uint32_t id = geo_lookup(db, ip);
+        const Geo_Record *rec = geo_get_record(db, id);
+
+        ++record_counts[rec ? id : 0];
+        ++total;
+
+        if (rec != NULL) {
+            fprintf(fp, "%s %u %c%c\n", ip, rec->asn, rec->country[0], rec->country[1]);
+        } else {
+            fprintf(fp, "%s 0 --\n", ip);
+        }
+    }
+
+    fclose(fp);
+
+    fp = geo_open_temp(agg_path);
+
+    if (fp == NULL) {
+        free(record_counts);
+        return -2;
+    }
+
+    const int ret = geo_write_aggregates(db, record_counts, total, fp);
+
+    fclose(fp);
+    free(record_counts);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (geo_commit_file(geo_path) != 0 || geo_commit_file(agg_path) != 0) {
+        return -3;
+    }
+
+    return 0;
+}
+
+typedef struct Geo_Log_IPs {
+    char     **ips;
+    uint32_t num_ips;
+} Geo_Log_IPs;
+
+static const char *geo_log_ip(void *user_data, uint32_t index, char *buf, size_t buf_len)
+{
+    const Geo_Log_IPs *log = user_data;
+    return log->ips[index];
+}
+
+int geo_enrich_log(const Geo_DB *db, const char *log_path)
+{
+    FILE *fp = fopen(log_path, "r");
+
+    if (fp == NULL) {
+        return -4;
+    }
+
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) == -1) {
+        fclose(fp);
+        return -4;
+    }
+
+    char *data = malloc(st.st_size + 1);
+    /* Log files hold space separated addresses, so there are at most half as many addresses as bytes */
+    char **ips = malloc((st.st_size / 2 + 1) * sizeof(char *));
+
+    if (data == NULL || ips == NULL || fread(data, 1, st.st_size, fp) != (size_t) st.st_size) {
+        free(data);
+        free(ips);
+        fclose(fp);
+        return data == NULL || ips == NULL ? -1 : -4;
+    }
+
+    fclose(fp);
+    data[st.st_size] = '\0';
+
+    Geo_Log_IPs log = { ips, 0 };
+    char *saveptr;
+
+    for (char *tok = strtok_r(data, " \t\r\n", &saveptr); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        log.ips[log.num_ips++] = tok;
+    }
+
+    size_t base_len = strlen(log_path);
+
+    if (base_len >= strlen(LOG_FILE_EXT) && strcmp(log_path + base_len - strlen(LOG_FILE_EXT), LOG_FILE_EXT) == 0) {
+        base_len -= strlen(LOG_FILE_EXT);
+    }
+
+    char base_path[base_len + 1];
+    snprintf(base_path, sizeof(base_path), "%.*s", (int) base_len, log_path);
+
+    const int ret = geo_enrich(db, base_path, geo_log_ip, &log, log.num_ips);
+
+    free(data);
+    free(ips);
+
+    return ret;
+}
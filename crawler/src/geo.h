@@ -0,0 +1,107 @@
+/*  geo.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef GEO_H
+#define GEO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Offline IP to ASN/country lookups.
+ *
+ * A text prefix database is compiled once into a binary file holding one poptrie for IPv4 and one
+ * for IPv6, which is then mmap'd read-only by the crawler. Lookups return a record id, where 0 means
+ * the address is not covered by the database.
+ */
+
+typedef struct Geo_DB Geo_DB;
+
+typedef struct Geo_Record {
+    uint32_t asn;
+    char     country[2];   /* ISO 3166-1 alpha-2 code, or "--" if unknown */
+    uint16_t reserved;
+} Geo_Record;
+
+/*
+ * Compiles the text prefix database at in_path into a binary database at out_path.
+ *
+ * Each line of the input is of the form `range_start range_end asn country [description]`, where
+ * range_start and range_end are inclusive IPv4 or IPv6 addresses (the iptoasn.com ip2asn-combined.tsv format).
+ * Lines with an ASN of 0 are ignored.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the input file cannot be read.
+ * Returns -2 on memory allocation failure.
+ * Returns -3 if the output file cannot be written.
+ */
+int geo_db_compile(const char *in_path, const char *out_path);
+
+/*
+ * Maps the binary database at path into memory.
+ *
+ * Returns NULL if the file cannot be mapped or is not a valid database.
+ */
+Geo_DB *geo_db_load(const char *path);
+
+void geo_db_free(Geo_DB *db);
+
+/* Returns the record id for an IPv4 address in host byte order. */
+uint32_t geo_lookup_ipv4(const Geo_DB *db, uint32_t addr);
+
+/* Returns the record id for a 16 byte IPv6 address in network byte order. */
+uint32_t geo_lookup_ipv6(const Geo_DB *db, const uint8_t *addr);
+
+/* Returns the record id for an IPv4 or IPv6 address string. IPv4-mapped IPv6 addresses are looked up as IPv4. */
+uint32_t geo_lookup(const Geo_DB *db, const char *ip);
+
+/* Returns the record for id, or NULL if id is 0 or out of range. */
+const Geo_Record *geo_get_record(const Geo_DB *db, uint32_t id);
+
+/*
+ * Returns the IP address string of the node at index, or NULL to skip it. buf may be used to
+ * hold the string.
+ */
+typedef const char *geo_ip_cb(void *user_data, uint32_t index, char *buf, size_t buf_len);
+
+/*
+ * Looks up num_ips addresses given by get_ip and writes the annotated nodes to base_path.geo, one
+ * `ip asn country` line per node, and the per-country and per-ASN node counts to base_path.agg.
+ *
+ * Returns 0 on success.
+ * Returns -1 on memory allocation failure.
+ * Returns -2 if an output file cannot be opened.
+ * Returns -3 if an output file cannot be renamed.
+ */
+int geo_enrich(const Geo_DB *db, const char *base_path, geo_ip_cb *get_ip, void *user_data, uint32_t num_ips);
+
+/*
+ * Enriches an existing crawler log file. The output files are written next to it, with the .cwl
+ * extension replaced.
+ *
+ * Returns 0 on success.
+ * Returns -4 if the log file cannot be read.
+ * Returns any error returned by geo_enrich() otherwise.
+ */
+int geo_enrich_log(const Geo_DB *db, const char *log_path);
+
+#endif  /* GEO_H */
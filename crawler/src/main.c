@@ -29,18 +29,38 @@
 #include <signal.h>
 #include <limits.h>
 #include <unistd.h>
-
-#include <tox/tox.h>
-//#include "../../../toxcore/toxcore/tox_private.h"
-#include "tox_private.h"
+#include <getopt.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <ctype.h>
 
 #include "util.h"
+#include "autoscale.h"
+#include "bootstrap.h"
+#include "engine.h"
+#include "geo.h"
+#include "nodes.h"
+
+/* Seconds between autoscaling decisions */
+#define AUTOSCALE_INTERVAL 5
+
+/* Number of bootstrap candidates a crawler is seeded with at a time */
+#define BOOTSTRAP_SEED_COUNT 4
+
+/* Seconds a crawler waits for its first response before bootstrapping from the next candidates */
+#define BOOTSTRAP_FALLBACK_TIMEOUT 3
 
-/* Seconds to wait between new crawler instances */
-#define NEW_CRAWLER_INTERVAL 180
+/* Seconds between probes of all bootstrap candidates */
+#define BOOTSTRAP_PROBE_INTERVAL 600
 
-/* Maximum number of concurrent crawler instances */
-#define MAX_CRAWLERS 4
+/* Milliseconds to wait for bootstrap candidates to answer a probe */
+#define BOOTSTRAP_PROBE_TIMEOUT 2000
+
+/* Milliseconds to hold back the first crawler for the first probe when no scores were saved. This
+ * leaves the probe time to start and send its requests before its own timeout runs out. */
+#define BOOTSTRAP_FIRST_PROBE_WAIT (BOOTSTRAP_PROBE_TIMEOUT + 1000)
+
+#define BOOTSTRAP_SCORES_PATH BASE_LOG_PATH "/bootstrap.scores"
 
 /* The number of passes we make through the nodes list before giving up */
 #define MAX_NUM_PASSES 3
@@ -48,9 +68,6 @@
 /* Seconds to wait for new nodes before a crawler times out and exits once pass limit is reached */
 #define CRAWLER_TIMEOUT 15
 
-/* Default maximum number of nodes the nodes list can store */
-#define DEFAULT_NODES_LIST_SIZE 131072
-
 /* Seconds to wait between getnodes requests */
 #define GETNODES_REQUEST_INTERVAL 0
 
@@ -60,21 +77,61 @@
 /* Number of random node requests to make for each node we send a request to */
 #define NUM_RAND_GETNODE_REQUESTS 15
 
-typedef struct DHT_Node {
-    uint8_t  public_key[TOX_DHT_NODE_PUBLIC_KEY_SIZE];
-    char     ip[TOX_DHT_NODE_IP_STRING_SIZE];
-    uint16_t port;
-} DHT_Node;
+/* Number of leading public key bits used to index verification probes. At most one probe is in
+ * flight per distinct prefix, which bounds the number of probes in flight. */
+#define VERIFY_BUCKET_BITS 12
+#define VERIFY_NUM_BUCKETS (1 << VERIFY_BUCKET_BITS)
+
+/* Seconds to wait for a response to a verification probe */
+#define VERIFY_TIMEOUT 3
+
+/* Number of verification probes we send to a node before declaring it unreachable */
+#define VERIFY_MAX_ATTEMPTS 2
+
+/* Max number of new verification probes to send per crawler iteration */
+#define MAX_VERIFY_REQUESTS 32
+
+/* Max number of nodes past the verification pointer that are looked at for a free probe bucket */
+#define VERIFY_SCAN_WINDOW 4096
+
+/* Seconds verification may go on after the crawl itself has finished. Nodes that haven't answered
+ * by then are logged as unverified. */
+#define VERIFY_GRACE_PERIOD 30
+
+#define LOG_FILE_EXT        ".cwl"
+#define VERIFIED_FILE_EXT   ".vcwl"
+#define UNVERIFIED_FILE_EXT ".ucwl"
+
+typedef enum Verify_State {
+    VERIFY_PENDING,
+    VERIFY_IN_FLIGHT,
+    VERIFY_OK,
+    VERIFY_FAILED,
+} Verify_State;
 
 typedef struct Crawler {
-    Tox          *tox;
-    DHT_Node     **nodes_list;
-    uint32_t     num_nodes;
-    uint32_t     nodes_list_size;
+    Engine       *engine;
+    Node_Store   nodes;
     uint32_t     send_ptr;    /* index of the oldest node that we haven't sent a getnodes request to */
     time_t       last_new_node;   /* Last time we found an unknown node */
     time_t       last_getnodes_request;
     size_t       passes;  /* How many times we've iterated the full nodes list */
+
+    /* Reachability verification; verify_engine is NULL if verification is disabled */
+    Engine       *verify_engine;
+    uint32_t     verify_ptr;   /* index of the oldest node that hasn't been verified or declared unreachable */
+    uint32_t     verify_slots[VERIFY_NUM_BUCKETS];   /* nodes list index + 1 of the node probed in each bucket */
+    time_t       verify_sent[VERIFY_NUM_BUCKETS];
+    uint32_t     num_verified;
+    time_t       crawl_done_time;   /* time the crawl finished and only verification was left, 0 until then */
+
+    Autoscale_Slot *scale;   /* NULL if the crawler is not managed by the supervisor */
+
+    Bootstrap_List *bootstrap;   /* ranked copy of the bootstrap candidates; NULL if not seeded */
+    uint16_t     bootstrap_next;   /* index of the next candidate to bootstrap from */
+    time_t       last_bootstrap;
+    uint64_t     created_ms;   /* monotonic time at creation, for measuring time to first response */
+
     pthread_t      tid;
     pthread_attr_t attr;
 } Crawler;
@@ -87,9 +144,31 @@ typedef struct Crawler {
 struct Threads {
     uint16_t  num_active;
     time_t    last_created;
+    time_t    last_autoscale;
+    const char *last_delay_reason;
+    bool      probing;   /* a bootstrap probe thread is running */
     pthread_mutex_t lock;
 } threads;
 
+/* Settings given on the command line */
+static struct Settings {
+    bool        verify_nodes;
+    bool        raw_engine;   /* crawl with the raw UDP engine instead of toxcore */
+    size_t      memory_budget;   /* bytes, 0 for unlimited */
+    const char  *geo_db_path;
+    const char  *geo_source_path;   /* text prefix database to compile into geo_db_path */
+    bool        enrich_logs;
+    const char  *bootstrap_path;   /* bootstrap candidates file; the built-in list is used if NULL */
+    Autoscale_Config autoscale;
+} settings;
+
+/* Bootstrap candidates ranked by their last probe. Read by the supervisor thread and replaced by the probe
+ * thread; both hold the threads lock while doing so. */
+static Bootstrap_List bootstrap_list;
+
+/* IP to ASN/country database used to enrich log files; NULL if not loaded */
+static Geo_DB *geo_db;
+
 static const struct toxNodes {
     const char *ip;
     uint16_t    port;
@@ -112,28 +191,157 @@ static const struct toxNodes {
     { NULL, 0, NULL },
 };
 
-/* Attempts to bootstrap to every listed bootstrap node */
-static void bootstrap_tox(Crawler *cwl)
+/*
+ * Bootstraps the crawler from its next BOOTSTRAP_SEED_COUNT candidates. Candidates are ranked, so
+ * the first call uses the fastest healthy nodes and later calls fall back to slower, untested and
+ * failing ones, then start over.
+ *
+ * Returns the number of candidates used.
+ */
+static uint16_t bootstrap_crawler(Crawler *cwl)
 {
-    for (size_t i = 0; bs_nodes[i].ip != NULL; ++i) {
-        char bin_key[TOX_PUBLIC_KEY_SIZE];
-        if (hex_string_to_bin(bs_nodes[i].key, strlen(bs_nodes[i].key), bin_key, sizeof(bin_key)) == -1) {
-            continue;
-        }
+    const Bootstrap_List *list = cwl->bootstrap;
+    uint16_t count = 0;
 
-        TOX_ERR_BOOTSTRAP err;
-        tox_bootstrap(cwl->tox, bs_nodes[i].ip, bs_nodes[i].port, (uint8_t *) bin_key, &err);
+    if (list == NULL || list->num_nodes == 0) {
+        return 0;
+    }
+
+    if (cwl->bootstrap_next >= list->num_nodes) {
+        cwl->bootstrap_next = 0;
+    }
+
+    while (count < BOOTSTRAP_SEED_COUNT && cwl->bootstrap_next < list->num_nodes) {
+        const Bootstrap_Node *bs = &list->nodes[cwl->bootstrap_next++];
+        char ip[NODE_IP_STRING_SIZE];
+        node_ip_string(&bs->node, ip, sizeof(ip));
 
-        if (err != TOX_ERR_BOOTSTRAP_OK) {
-            fprintf(stderr, "Failed to bootstrap DHT via: %s %d (error %d)\n", bs_nodes[i].ip, bs_nodes[i].port, err);
+        const int err = engine_bootstrap(cwl->engine, ip, bs->node.port, bs->node.public_key);
+
+        if (err != 0) {
+            fprintf(stderr, "Failed to bootstrap DHT via: %s %d (error %d)\n", ip, bs->node.port, err);
         } else {
-            fprintf(stderr, "OK: bootstraped DHT via: %s %d (error %d)\n", bs_nodes[i].ip, bs_nodes[i].port, err);
+            fprintf(stderr, "OK: bootstraped DHT via: %s %d (rtt %.1f ms)\n", ip, bs->node.port, bs->rtt_ms);
         }
+
+        ++count;
     }
+
+    cwl->last_bootstrap = get_time();
+
+    return count;
+}
+
+/* Adds the built-in bootstrap nodes to list. */
+static void bootstrap_add_defaults(Bootstrap_List *list)
+{
+    for (size_t i = 0; bs_nodes[i].ip != NULL; ++i) {
+        bootstrap_add(list, bs_nodes[i].ip, bs_nodes[i].port, bs_nodes[i].key);
+    }
+}
+
+/*
+ * Probes a copy of the bootstrap candidates, ranks them, saves the new scores and replaces the
+ * candidates with the ranked copy, which it frees.
+ */
+static void *do_bootstrap_probe(void *data)
+{
+    Bootstrap_List *list = (Bootstrap_List *) data;
+    const int ret = bootstrap_probe(list, BOOTSTRAP_PROBE_TIMEOUT);
+
+    if (ret < 0) {
+        fprintf(stderr, "bootstrap_probe() failed with error %d\n", ret);
+        list->last_probe = get_time();
+    } else {
+        fprintf(stderr, "Bootstrap probe: %d of %u nodes answered\n", ret, list->num_nodes);
+
+        bootstrap_rank(list);
+
+        if (mkdir(BASE_LOG_PATH, 0700) == 0 || errno == EEXIST) {
+            const int err = bootstrap_save_scores(list, BOOTSTRAP_SCORES_PATH);
+
+            if (err != 0) {
+                fprintf(stderr, "bootstrap_save_scores() failed with error %d\n", err);
+            }
+        }
+    }
+
+    LOCK;
+    memcpy(&bootstrap_list, list, sizeof(Bootstrap_List));
+    threads.probing = false;
+    UNLOCK;
+
+    free(list);
+
+    return 0;
+}
+
+/*
+ * Starts probing the bootstrap candidates in a new thread if their scores are out of date, so that
+ * new crawlers are seeded from nodes that are alive. The probe waits for answers for up to
+ * BOOTSTRAP_PROBE_TIMEOUT milliseconds, so it is kept off the supervisor thread. Crawlers started in
+ * the meantime are seeded from the previous ranking, except on a cold start (see wait_for_first_probe()).
+ *
+ * Returns 0 on success or if no probe is needed.
+ * Returns -1 on memory allocation failure.
+ * Returns -2 if the thread fails to start.
+ */
+static int update_bootstrap_scores(void)
+{
+    LOCK;
+
+    if (threads.probing || !timed_out(bootstrap_list.last_probe, BOOTSTRAP_PROBE_INTERVAL)) {
+        UNLOCK;
+        return 0;
+    }
+
+    Bootstrap_List *list = malloc(sizeof(Bootstrap_List));
+
+    if (list == NULL) {
+        UNLOCK;
+        return -1;
+    }
+
+    memcpy(list, &bootstrap_list, sizeof(Bootstrap_List));
+
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (pthread_attr_init(&attr) != 0) {
+        UNLOCK;
+        free(list);
+        return -2;
+    }
+
+    const bool started = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0
+                         && pthread_create(&tid, &attr, do_bootstrap_probe, (void *) list) == 0;
+
+    pthread_attr_destroy(&attr);
+
+    if (!started) {
+        /* Don't try again before the next interval */
+        bootstrap_list.last_probe = get_time();
+        UNLOCK;
+        free(list);
+        return -2;
+    }
+
+    threads.probing = true;
+    UNLOCK;
+
+    return 0;
 }
 
 #define MIN(x, y)((x) < (y) ? (x) : (y))
 
+/* Returns the current monotonic time in milliseconds. */
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
 static volatile bool FLAG_EXIT = false;
 static void catch_SIGINT(int sig)
 {
@@ -142,14 +350,11 @@ static void catch_SIGINT(int sig)
     UNLOCK;
 }
 
-/*
- * Return true if public_key is in the crawler's nodes list.
- * TODO: A hashtable would be nice but the str8C holds up for now.
- */
-static bool node_crawled(Crawler *cwl, const uint8_t *public_key)
+/* Returns true if any bootstrap candidate has answered or missed a probe. */
+static bool bootstrap_scored(const Bootstrap_List *list)
 {
-    for (uint32_t i = 0; i < cwl->num_nodes; ++i) {
-        if (memcmp(cwl->nodes_list[i]->public_key, public_key, TOX_DHT_NODE_PUBLIC_KEY_SIZE) == 0) {
+    for (uint16_t i = 0; i < list->num_nodes; ++i) {
+        if (list->nodes[i].successes > 0 || list->nodes[i].failures > 0) {
             return true;
         }
     }
@@ -157,47 +362,187 @@ static bool node_crawled(Crawler *cwl, const uint8_t *public_key)
     return false;
 }
 
-void cb_getnodes_response(Tox *tox, const uint8_t *public_key, const char *ip, uint16_t port, void *user_data)
+/*
+ * Starts the first bootstrap probe and waits up to BOOTSTRAP_FIRST_PROBE_WAIT milliseconds for it to
+ * finish, so that the first crawler isn't seeded from candidates that are down. Only used when no
+ * scores were saved; later probes run in the background.
+ */
+static void wait_for_first_probe(void)
+{
+    const int err = update_bootstrap_scores();
+
+    if (err != 0) {
+        fprintf(stderr, "update_bootstrap_scores() failed with error %d\n", err);
+        return;
+    }
+
+    const uint64_t start = monotonic_ms();
+
+    while (monotonic_ms() - start < BOOTSTRAP_FIRST_PROBE_WAIT) {
+        LOCK;
+        const bool done = !threads.probing || FLAG_EXIT;
+        UNLOCK;
+
+        if (done) {
+            return;
+        }
+
+        usleep(10000);
+    }
+
+    fprintf(stderr, "Bootstrap probe still running; starting the first crawler anyway\n");
+}
+
+/* Return true if public_key is in the crawler's nodes list. */
+static bool node_crawled(Crawler *cwl, const uint8_t *public_key)
+{
+    return nodes_contains(&cwl->nodes, public_key);
+}
+
+static uint32_t verify_bucket(const uint8_t *public_key)
+{
+    return ((uint32_t) public_key[0] << 8 | public_key[1]) >> (16 - VERIFY_BUCKET_BITS);
+}
+
+void cb_getnodes_response(void *user_data, const uint8_t *responder_key, const DHT_Node *node)
 {
     Crawler *cwl = (Crawler *)user_data;
 
-    if (cwl == NULL) {
+    if (cwl == NULL || node == NULL) {
         return;
     }
 
-    if (public_key == NULL || ip == NULL) {
+    if (node_crawled(cwl, node->public_key)) {
         return;
     }
 
-    if (node_crawled(cwl, public_key)) {
+    DHT_Node new_node = *node;
+    new_node.verify_state = VERIFY_PENDING;
+    new_node.verify_attempts = 0;
+
+    if (nodes_add(&cwl->nodes, &new_node) != 0) {
         return;
     }
 
-    if (cwl->num_nodes + 1 >= cwl->nodes_list_size) {
-        DHT_Node **tmp = realloc(cwl->nodes_list, cwl->nodes_list_size * 2 * sizeof(DHT_Node *));
+    if (cwl->scale != NULL) {
+        autoscale_note_node(cwl->scale, new_node.public_key);
+    }
 
-        if (tmp == NULL) {
-            return;
-        }
+    cwl->last_new_node = get_time();
 
-        cwl->nodes_list = tmp;
-        cwl->nodes_list_size *= 2;
+    if (cwl->nodes.num_nodes == 1) {
+        fprintf(stderr, "First response after %llu ms\n", (unsigned long long) (monotonic_ms() - cwl->created_ms));
     }
 
-    DHT_Node *new_node = calloc(1, sizeof(DHT_Node));
+    char ip[NODE_IP_STRING_SIZE];
+    fprintf(stderr, "Node %u: %s:%u\n", cwl->nodes.num_nodes, node_ip_string(node, ip, sizeof(ip)), node->port);
+}
 
-    if (new_node == NULL) {
+/*
+ * Getnodes response callback for the verification instance.
+ *
+ * The verification instance is always a raw engine, which tells us the key of the node that sent the
+ * response. Responses are encrypted with that key, so a node is only verified by a response it sent
+ * itself. Responses are also fed into the crawl.
+ */
+static void cb_verify_response(void *user_data, const uint8_t *responder_key, const DHT_Node *node)
+{
+    Crawler *cwl = (Crawler *)user_data;
+
+    if (cwl == NULL) {
         return;
     }
 
-    memcpy(new_node->public_key, public_key, TOX_DHT_NODE_PUBLIC_KEY_SIZE);
-    snprintf(new_node->ip, sizeof(new_node->ip), "%s", ip);
-    new_node->port = port;
+    /* A response without nodes still verifies its sender */
+    if (responder_key != NULL) {
+        const uint32_t bucket = verify_bucket(responder_key);
+        const uint32_t slot = cwl->verify_slots[bucket];
+        DHT_Node *probed = slot != 0 ? nodes_get_mutable(&cwl->nodes, slot - 1) : NULL;
 
-    cwl->nodes_list[cwl->num_nodes++] = new_node;
-    cwl->last_new_node = get_time();
+        if (probed != NULL && memcmp(probed->public_key, responder_key, NODE_PUBLIC_KEY_SIZE) == 0) {
+            probed->verify_state = VERIFY_OK;
+            cwl->verify_slots[bucket] = 0;
+            ++cwl->num_verified;
+        }
+    }
+
+    cb_getnodes_response(user_data, responder_key, node);
+}
+
+/* Sends a verification probe to node, which is at index i of the nodes list. */
+static void send_verify_request(Crawler *cwl, DHT_Node *node, uint32_t i)
+{
+    const uint32_t bucket = verify_bucket(node->public_key);
+
+    engine_get_nodes(cwl->verify_engine, node, node->public_key);
+
+    node->verify_state = VERIFY_IN_FLIGHT;
+    ++node->verify_attempts;
+    cwl->verify_slots[bucket] = i + 1;
+    cwl->verify_sent[bucket] = get_time();
+}
+
+/*
+ * Retries or gives up on timed out verification probes, and sends probes to up to MAX_VERIFY_REQUESTS
+ * nodes that haven't been verified yet.
+ *
+ * Returns the number of new probes sent.
+ */
+static size_t send_verify_requests(Crawler *cwl)
+{
+    for (uint32_t b = 0; b < VERIFY_NUM_BUCKETS; ++b) {
+        const uint32_t slot = cwl->verify_slots[b];
+
+        if (slot == 0 || !timed_out(cwl->verify_sent[b], VERIFY_TIMEOUT)) {
+            continue;
+        }
+
+        DHT_Node *node = nodes_get_mutable(&cwl->nodes, slot - 1);
+
+        if (node == NULL || node->verify_attempts >= VERIFY_MAX_ATTEMPTS) {
+            if (node != NULL) {
+                node->verify_state = VERIFY_FAILED;
+            }
+
+            cwl->verify_slots[b] = 0;
+        } else {
+            send_verify_request(cwl, node, slot - 1);
+        }
+    }
+
+    /* Nodes behind the verification pointer won't change any more, so they can be spilled to disk */
+    while (cwl->verify_ptr < cwl->nodes.num_nodes) {
+        const DHT_Node *node = nodes_get_mutable(&cwl->nodes, cwl->verify_ptr);
+
+        if (node != NULL && node->verify_state < VERIFY_OK) {
+            break;
+        }
+
+        ++cwl->verify_ptr;
+    }
+
+    const uint32_t end = MIN(cwl->nodes.num_nodes, cwl->verify_ptr + VERIFY_SCAN_WINDOW);
+    size_t count = 0;
+
+    for (uint32_t i = cwl->verify_ptr; count < MAX_VERIFY_REQUESTS && i < end; ++i) {
+        DHT_Node *node = nodes_get_mutable(&cwl->nodes, i);
+
+        if (node == NULL || node->verify_state != VERIFY_PENDING
+                || cwl->verify_slots[verify_bucket(node->public_key)] != 0) {
+            continue;
+        }
+
+        send_verify_request(cwl, node, i);
+        ++count;
+    }
 
-    fprintf(stderr, "Node %u: %s:%u\n", cwl->num_nodes, ip, port);
+    return count;
+}
+
+/* Returns true if every node in the nodes list has either been verified or declared unreachable. */
+static bool verification_done(const Crawler *cwl)
+{
+    return cwl->verify_engine == NULL || cwl->verify_ptr == cwl->nodes.num_nodes;
 }
 
 /*
@@ -213,20 +558,33 @@ static size_t send_node_requests(Crawler *cwl)
     size_t count = 0;
     uint32_t i;
 
-    for (i = cwl->send_ptr; count < MAX_GETNODES_REQUESTS && i < cwl->num_nodes; ++i) {
-        const DHT_Node *node = cwl->nodes_list[i];
+    for (i = cwl->send_ptr; count < MAX_GETNODES_REQUESTS && i < cwl->nodes.num_nodes; ++i) {
+        DHT_Node node_buf;
+        const DHT_Node *node = nodes_get(&cwl->nodes, i, &node_buf);
 
-        Tox_Err_Dht_Get_Nodes err;
-        tox_dht_get_nodes(cwl->tox, node->public_key, node->ip, node->port, node->public_key, &err);
+        /* Don't waste requests on nodes that failed to answer verification probes */
+        if (node == NULL || node->verify_state == VERIFY_FAILED) {
+            continue;
+        }
 
-        const size_t num_rand_requests = MIN(NUM_RAND_GETNODE_REQUESTS / 2, cwl->num_nodes);
+        engine_get_nodes(cwl->engine, node, node->public_key);
+
+        /* Random nodes are only picked from memory, since reading a spilled node costs a system call */
+        const uint32_t first = nodes_first_resident(&cwl->nodes);
+        const uint32_t num_resident = cwl->nodes.num_nodes - first;
+        const size_t num_rand_requests = MIN(NUM_RAND_GETNODE_REQUESTS / 2, num_resident);
 
         for (size_t j = 0; j < num_rand_requests; ++j) {
-            const uint32_t r = rand() % cwl->num_nodes;
-            const DHT_Node *rand_node = cwl->nodes_list[r];
+            const uint32_t r = first + rand() % num_resident;
+            DHT_Node rand_buf;
+            const DHT_Node *rand_node = nodes_get(&cwl->nodes, r, &rand_buf);
+
+            if (rand_node == NULL || rand_node->verify_state == VERIFY_FAILED) {
+                continue;
+            }
 
-            tox_dht_get_nodes(cwl->tox, node->public_key, node->ip, node->port, rand_node->public_key, NULL);
-            tox_dht_get_nodes(cwl->tox, rand_node->public_key, rand_node->ip, rand_node->port, node->public_key, NULL);
+            engine_get_nodes(cwl->engine, node, rand_node->public_key);
+            engine_get_nodes(cwl->engine, rand_node, node->public_key);
         }
 
         ++count;
@@ -235,7 +593,7 @@ static size_t send_node_requests(Crawler *cwl)
     cwl->send_ptr = i;
     cwl->last_getnodes_request = get_time();
 
-    if (cwl->send_ptr == cwl->num_nodes) {
+    if (cwl->send_ptr == cwl->nodes.num_nodes) {
         ++cwl->passes;
         cwl->send_ptr = 0;
     }
@@ -244,10 +602,10 @@ static size_t send_node_requests(Crawler *cwl)
 }
 
 /*
- * Returns a pointer to an inactive crawler in the threads array.
- * Returns NULL if there are no crawlers available.
+ * Returns a new crawler using the given engine type that has not been bootstrapped.
+ * Returns NULL on failure.
  */
-Crawler *crawler_new(void)
+static Crawler *crawler_create(Engine_Type type)
 {
     Crawler *cwl = calloc(1, sizeof(Crawler));
 
@@ -255,51 +613,104 @@ Crawler *crawler_new(void)
         return cwl;
     }
 
-    DHT_Node **nodes_list = calloc(DEFAULT_NODES_LIST_SIZE, sizeof(DHT_Node *));
+    cwl->engine = engine_new(type, cb_getnodes_response);
 
-    if (nodes_list == NULL) {
+    if (cwl->engine == NULL) {
         free(cwl);
         return NULL;
     }
 
-    struct Tox_Options options;
-    tox_options_default(&options);
+    nodes_init(&cwl->nodes);
 
-    TOX_ERR_NEW err;
-    Tox *tox = tox_new(&options, &err);
+    /* A toxcore instance would also query the nodes it hears about on its own, and doesn't tell us
+     * which node a response came from, so probes always go through a raw engine. It is never
+     * bootstrapped, so the only nodes it hears from are the ones we probe. */
+    if (settings.verify_nodes) {
+        cwl->verify_engine = engine_new(ENGINE_RAW, cb_verify_response);
 
-    if (err != TOX_ERR_NEW_OK || tox == NULL) {
-        fprintf(stderr, "tox_new() failed: %d\n", err);
-        free(cwl);
-        free(nodes_list);
-        return NULL;
+        if (cwl->verify_engine == NULL) {
+            fprintf(stderr, "engine_new() failed for verification instance\n");
+            engine_kill(cwl->engine);
+            free(cwl);
+            return NULL;
+        }
     }
 
-    cwl->tox = tox;
-    cwl->nodes_list = nodes_list;
-    cwl->nodes_list_size = DEFAULT_NODES_LIST_SIZE;
-
-    tox_callback_dht_get_nodes_response(tox, cb_getnodes_response);
-
     cwl->last_getnodes_request = get_time();
     cwl->last_new_node = get_time();
-
-    bootstrap_tox(cwl);
+    cwl->created_ms = monotonic_ms();
 
     return cwl;
 }
 
-#define TEMP_FILE_EXT ".tmp"
-
-/* Dumps crawler nodes list to log file. */
-static int crawler_dump_log(Crawler *cwl)
+/*
+ * Gives the crawler its own copy of the ranked bootstrap candidates in list and bootstraps it from
+ * the first ones.
+ *
+ * Returns 0 on success.
+ * Returns -1 on memory allocation failure.
+ */
+static int crawler_seed(Crawler *cwl, const Bootstrap_List *list)
 {
-    char log_path[PATH_MAX];
+    cwl->bootstrap = malloc(sizeof(Bootstrap_List));
 
-    if (get_log_path(log_path, sizeof(log_path)) == -1) {
+    if (cwl->bootstrap == NULL) {
         return -1;
     }
 
+    memcpy(cwl->bootstrap, list, sizeof(Bootstrap_List));
+    cwl->bootstrap_next = 0;
+
+    bootstrap_crawler(cwl);
+
+    return 0;
+}
+
+static void crawler_kill(Crawler *cwl);
+
+/*
+ * Returns a pointer to an inactive crawler in the threads array.
+ * Returns NULL if there are no crawlers available.
+ */
+Crawler *crawler_new(void)
+{
+    Crawler *cwl = crawler_create(settings.raw_engine ? ENGINE_RAW : ENGINE_TOX);
+
+    if (cwl == NULL) {
+        return NULL;
+    }
+
+    LOCK;
+    const int ret = crawler_seed(cwl, &bootstrap_list);
+    UNLOCK;
+
+    if (ret != 0) {
+        crawler_kill(cwl);
+        return NULL;
+    }
+
+    return cwl;
+}
+
+#define TEMP_FILE_EXT ".tmp"
+
+/* Which nodes from the nodes list to write to a log file */
+typedef enum Log_Filter {
+    LOG_ALL,
+    LOG_VERIFIED,
+    LOG_UNVERIFIED,
+} Log_Filter;
+
+/*
+ * Writes the IP addresses of the nodes selected by filter to log_path.
+ *
+ * Returns 0 on success.
+ * Returns -2 if the file cannot be opened.
+ * Returns -3 if the file cannot be renamed.
+ * Returns -4 if a spilled node cannot be read back.
+ */
+static int crawler_write_log(const Crawler *cwl, const char *log_path, Log_Filter filter)
+{
     char log_path_temp[strlen(log_path) + strlen(TEMP_FILE_EXT) + 1];
     snprintf(log_path_temp, sizeof(log_path_temp), "%s%s", log_path, TEMP_FILE_EXT);
 
@@ -309,8 +720,23 @@ static int crawler_dump_log(Crawler *cwl)
         return -2;
     }
 
-    for (uint32_t i = 0; i < cwl->num_nodes; ++i) {
-        fprintf(fp, "%s ", cwl->nodes_list[i]->ip);
+    for (uint32_t i = 0; i < cwl->nodes.num_nodes; ++i) {
+        DHT_Node node_buf;
+        const DHT_Node *node = nodes_get(&cwl->nodes, i, &node_buf);
+
+        if (node == NULL) {
+            fclose(fp);
+            remove(log_path_temp);
+            return -4;
+        }
+
+        if ((filter == LOG_VERIFIED && node->verify_state != VERIFY_OK)
+                || (filter == LOG_UNVERIFIED && node->verify_state == VERIFY_OK)) {
+            continue;
+        }
+
+        char ip[NODE_IP_STRING_SIZE];
+        fprintf(fp, "%s ", node_ip_string(node, ip, sizeof(ip)));
     }
 
     fclose(fp);
@@ -322,24 +748,98 @@ static int crawler_dump_log(Crawler *cwl)
     return 0;
 }
 
+static const char *crawler_node_ip(void *user_data, uint32_t index, char *buf, size_t buf_len)
+{
+    const Crawler *cwl = (const Crawler *) user_data;
+    DHT_Node node_buf;
+    const DHT_Node *node = nodes_get(&cwl->nodes, index, &node_buf);
+
+    return node ? node_ip_string(node, buf, buf_len) : NULL;
+}
+
+/* Dumps crawler nodes list to log file.
+ *
+ * If verification is enabled the verified and unverified nodes are additionally written to
+ * separate files next to the log file, with the extensions VERIFIED_FILE_EXT and UNVERIFIED_FILE_EXT.
+ * If a geo database is loaded the nodes are annotated with their ASN and country as well.
+ */
+static int crawler_dump_log(Crawler *cwl)
+{
+    char log_path[PATH_MAX];
+
+    if (get_log_path(log_path, sizeof(log_path)) == -1) {
+        return -1;
+    }
+
+    const size_t base_len = strlen(log_path) - strlen(LOG_FILE_EXT);
+
+    if (geo_db != NULL) {
+        char base_path[base_len + 1];
+        snprintf(base_path, sizeof(base_path), "%.*s", (int) base_len, log_path);
+
+        const int ret = geo_enrich(geo_db, base_path, crawler_node_ip, cwl, cwl->nodes.num_nodes);
+
+        if (ret != 0) {
+            fprintf(stderr, "geo_enrich() failed with error %d\n", ret);
+        }
+    }
+
+    if (cwl->verify_engine != NULL) {
+        char path[base_len + strlen(UNVERIFIED_FILE_EXT) + 1];
+
+        snprintf(path, sizeof(path), "%.*s%s", (int) base_len, log_path, VERIFIED_FILE_EXT);
+        int ret = crawler_write_log(cwl, path, LOG_VERIFIED);
+
+        if (ret != 0) {
+            return ret;
+        }
+
+        snprintf(path, sizeof(path), "%.*s%s", (int) base_len, log_path, UNVERIFIED_FILE_EXT);
+        ret = crawler_write_log(cwl, path, LOG_UNVERIFIED);
+
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return crawler_write_log(cwl, log_path, LOG_ALL);
+}
+
 static void crawler_kill(Crawler *cwl)
 {
     pthread_attr_destroy(&cwl->attr);
-    tox_kill(cwl->tox);
+    engine_kill(cwl->engine);
+    engine_kill(cwl->verify_engine);
 
-    for (size_t i = 0; i < cwl->num_nodes; ++i) {
-        free(cwl->nodes_list[i]);
+    if (cwl->scale != NULL) {
+        autoscale_release(cwl->scale);
     }
 
-    free(cwl->nodes_list);
+    nodes_free(&cwl->nodes);
+    free(cwl->bootstrap);
     free(cwl);
 }
 
-/* Returns true if the crawler is unable to find new nodes in the DHT or the exit flag has been triggered */
+/* Returns true if the crawler is unable to find new nodes in the DHT and has finished verifying the
+ * nodes it found or run out of time to do so, the supervisor has asked it to stop, or the exit flag
+ * has been triggered */
 static bool crawler_finished(Crawler *cwl)
 {
+    if (cwl->scale != NULL && autoscale_stop_requested(cwl->scale)) {
+        return true;
+    }
+
+    const bool crawl_done = cwl->passes >= MAX_NUM_PASSES && timed_out(cwl->last_new_node, CRAWLER_TIMEOUT);
+
+    if (crawl_done && cwl->crawl_done_time == 0) {
+        cwl->crawl_done_time = get_time();
+    }
+
+    const bool verify_done = verification_done(cwl)
+                             || (crawl_done && timed_out(cwl->crawl_done_time, VERIFY_GRACE_PERIOD));
+
     LOCK;
-    if (FLAG_EXIT || (cwl->passes >= MAX_NUM_PASSES && timed_out(cwl->last_new_node, CRAWLER_TIMEOUT))) {
+    if (FLAG_EXIT || (crawl_done && verify_done)) {
         UNLOCK;
         return true;
     }
@@ -348,19 +848,54 @@ static bool crawler_finished(Crawler *cwl)
     return false;
 }
 
+/* Returns the CPU time used by the calling thread in nanoseconds. */
+static uint64_t thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
 void *do_crawler_thread(void *data)
 {
     Crawler *cwl = (Crawler *) data;
 
     while (!crawler_finished(cwl)) {
-        tox_iterate(cwl->tox, cwl);
+        engine_iterate(cwl->engine, cwl);
         send_node_requests(cwl);
-        usleep(tox_iteration_interval(cwl->tox) * 1000);
+
+        /* Fall back to the next bootstrap candidates if none of the previous ones answered */
+        if (cwl->nodes.num_nodes == 0 && timed_out(cwl->last_bootstrap, BOOTSTRAP_FALLBACK_TIMEOUT)) {
+            bootstrap_crawler(cwl);
+        }
+
+        if (cwl->verify_engine != NULL) {
+            engine_iterate(cwl->verify_engine, cwl);
+            send_verify_requests(cwl);
+        }
+
+        nodes_set_cold_limit(&cwl->nodes, cwl->verify_engine != NULL ? cwl->verify_ptr : cwl->nodes.num_nodes);
+
+        if (cwl->scale != NULL) {
+            autoscale_report(cwl->scale, cwl->nodes.num_nodes, (uint32_t) cwl->passes, thread_cpu_time());
+        }
+
+        usleep(engine_iteration_interval(cwl->engine) * 1000);
     }
 
     char time_format[128];
     get_time_format(time_format, sizeof(time_format));
-    fprintf(stderr, "[%s] Nodes: %llu\n", time_format, (unsigned long long) cwl->num_nodes);
+
+    if (cwl->verify_engine != NULL) {
+        fprintf(stderr, "[%s] Nodes: %llu (verified: %llu)\n", time_format, (unsigned long long) cwl->nodes.num_nodes,
+                (unsigned long long) cwl->num_verified);
+    } else {
+        fprintf(stderr, "[%s] Nodes: %llu\n", time_format, (unsigned long long) cwl->nodes.num_nodes);
+    }
 
     LOCK;
     const bool interrupted = FLAG_EXIT;
@@ -410,34 +945,74 @@ static int init_crawler_thread(Crawler *cwl)
 }
 
 /*
- * Creates new crawler instances.
+ * Starts or stops crawler instances as decided by the autoscaler.
  *
- * Returns 0 on success or if new instance is not needed.
+ * Returns 0 on success or if no action is needed.
  * Returns -1 if crawler instance fails to initialize.
  * Returns -2 if thread fails to initialize.
  */
 static int do_thread_control(void)
 {
-    LOCK;
-    if (threads.num_active >= MAX_CRAWLERS || !timed_out(threads.last_created, NEW_CRAWLER_INTERVAL)) {
-        UNLOCK;
+    if (!timed_out(threads.last_autoscale, AUTOSCALE_INTERVAL)) {
         return 0;
     }
-    UNLOCK;
+
+    threads.last_autoscale = get_time();
+
+    const int err = update_bootstrap_scores();
+
+    if (err != 0) {
+        fprintf(stderr, "update_bootstrap_scores() failed with error %d\n", err);
+    }
+
+    const Autoscale_Decision decision = autoscale_update(&settings.autoscale, get_time() - threads.last_created);
+
+    switch (decision.action) {
+        case AUTOSCALE_START:
+            break;
+
+        case AUTOSCALE_STOP:
+            fprintf(stderr, "Stopping crawler %u: %s\n", decision.crawler_id, decision.reason);
+            autoscale_request_stop(decision.crawler_id);
+            return 0;
+
+        case AUTOSCALE_DELAY:
+            if (decision.reason != threads.last_delay_reason) {
+                fprintf(stderr, "Delaying new crawler: %s\n", decision.reason);
+                threads.last_delay_reason = decision.reason;
+            }
+
+            return 0;
+
+        default:
+            return 0;
+    }
+
+    threads.last_delay_reason = NULL;
+
+    Autoscale_Slot *scale = autoscale_register();
+
+    if (scale == NULL) {
+        return -1;
+    }
 
     Crawler *cwl = crawler_new();
 
     if (cwl == NULL) {
+        autoscale_release(scale);
         return -1;
     }
 
+    cwl->scale = scale;
+
     const int ret = init_crawler_thread(cwl);
 
     if (ret != 0) {
         fprintf(stderr, "init_crawler_thread() failed with error: %d\n", ret);
+        autoscale_release(cwl->scale);
         return -2;
     } else {
-        fprintf(stderr, "init_crawler_thread() OK error: %d\n", ret);
+        fprintf(stderr, "init_crawler_thread() OK error: %d (%s)\n", ret, decision.reason);
     }
 
     threads.last_created = get_time();
@@ -449,8 +1024,215 @@ static int do_thread_control(void)
     return 0;
 }
 
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r] [-v] [-b nodes_file] [-n min:max] [-m megabytes]\n", name);
+    fprintf(stderr, "       %*s [-g geo_db [-c prefix_file | -e log_file...]]\n", (int) strlen(name), "");
+    fprintf(stderr, "  -r              Crawl with the built-in raw UDP DHT client instead of toxcore\n");
+    fprintf(stderr, "  -v              Verify that discovered nodes are reachable by probing them directly\n");
+    fprintf(stderr, "  -b nodes_file   Bootstrap from the nodes listed in nodes_file, one \"ip port key\" per\n");
+    fprintf(stderr, "                  line, instead of the built-in list\n");
+    fprintf(stderr, "  -n min:max      Bounds for the number of concurrent crawlers (default %d:%d)\n",
+            AUTOSCALE_DEFAULT_MIN_CRAWLERS, AUTOSCALE_DEFAULT_MAX_CRAWLERS);
+    fprintf(stderr, "  -m megabytes    Memory budget for the nodes lists of all crawlers; older nodes are\n");
+    fprintf(stderr, "                  spilled to disk once it is reached\n");
+    fprintf(stderr, "  -g geo_db       Annotate log files with ASN and country data from geo_db\n");
+    fprintf(stderr, "  -c prefix_file  Compile the text prefix database prefix_file into geo_db and exit\n");
+    fprintf(stderr, "  -e              Annotate the given existing log files and exit\n");
+}
+
+/*
+ * Runs the offline geo database commands.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the database cannot be compiled.
+ * Returns -2 if the database cannot be loaded.
+ * Returns -3 if a log file cannot be enriched.
+ */
+static int do_geo_commands(int argc, char **argv)
+{
+    if (settings.geo_source_path != NULL) {
+        const int ret = geo_db_compile(settings.geo_source_path, settings.geo_db_path);
+
+        if (ret != 0) {
+            fprintf(stderr, "geo_db_compile() failed with error %d\n", ret);
+            return -1;
+        }
+    }
+
+    if (!settings.enrich_logs) {
+        return 0;
+    }
+
+    Geo_DB *db = geo_db_load(settings.geo_db_path);
+
+    if (db == NULL) {
+        fprintf(stderr, "Failed to load geo database %s\n", settings.geo_db_path);
+        return -2;
+    }
+
+    int ret = 0;
+
+    for (int i = 0; i < argc; ++i) {
+        const int err = geo_enrich_log(db, argv[i]);
+
+        if (err != 0) {
+            fprintf(stderr, "geo_enrich_log() failed for %s with error %d\n", argv[i], err);
+            ret = -3;
+        }
+    }
+
+    geo_db_free(db);
+
+    return ret;
+}
+
+/*
+ * Parses the number at *str, which must start with a digit, and advances *str past it.
+ *
+ * Returns 0 on success.
+ * Returns -1 if there is no number or it is above max.
+ */
+static int parse_bounded_number(const char **str, unsigned long max, uint16_t *value)
+{
+    char *end;
+
+    if (!isdigit((unsigned char) **str)) {
+        return -1;
+    }
+
+    errno = 0;
+    const unsigned long n = strtoul(*str, &end, 10);
+
+    if (errno != 0 || n > max) {
+        return -1;
+    }
+
+    *value = (uint16_t) n;
+    *str = end;
+
+    return 0;
+}
+
+/*
+ * Parses crawler bounds given as "min:max" into config.
+ *
+ * Returns 0 on success.
+ * Returns -1 if arg is malformed or the bounds are out of range.
+ */
+static int parse_crawler_bounds(const char *arg, Autoscale_Config *config)
+{
+    uint16_t min, max;
+
+    if (parse_bounded_number(&arg, AUTOSCALE_MAX_SLOTS, &min) != 0 || *arg++ != ':'
+            || parse_bounded_number(&arg, AUTOSCALE_MAX_SLOTS, &max) != 0 || *arg != '\0') {
+        return -1;
+    }
+
+    if (max == 0 || min > max) {
+        return -1;
+    }
+
+    config->min_crawlers = min;
+    config->max_crawlers = max;
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    int opt;
+
+    autoscale_default_config(&settings.autoscale);
+
+    while ((opt = getopt(argc, argv, "rvb:n:m:g:c:eh")) != -1) {
+        switch (opt) {
+            case 'r':
+                settings.raw_engine = true;
+                break;
+
+            case 'v':
+                settings.verify_nodes = true;
+                break;
+
+            case 'b':
+                settings.bootstrap_path = optarg;
+                break;
+
+            case 'n':
+                if (parse_crawler_bounds(optarg, &settings.autoscale) != 0) {
+                    fprintf(stderr, "Invalid crawler bounds: %s (max is at most %d)\n", optarg, AUTOSCALE_MAX_SLOTS);
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'm': {
+                char *end;
+                errno = 0;
+                const unsigned long long megabytes = strtoull(optarg, &end, 10);
+
+                if (errno != 0 || end == optarg || *end != '\0' || strchr(optarg, '-') != NULL || megabytes == 0
+                        || megabytes > SIZE_MAX / (1024 * 1024)) {
+                    fprintf(stderr, "Invalid memory budget: %s (expected a positive number of megabytes)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+
+                settings.memory_budget = megabytes * 1024 * 1024;
+                break;
+            }
+
+            case 'g':
+                settings.geo_db_path = optarg;
+                break;
+
+            case 'c':
+                settings.geo_source_path = optarg;
+                break;
+
+            case 'e':
+                settings.enrich_logs = true;
+                break;
+
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if ((settings.geo_source_path != NULL || settings.enrich_logs) && settings.geo_db_path == NULL) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (settings.geo_source_path != NULL || settings.enrich_logs) {
+        exit(do_geo_commands(argc - optind, argv + optind) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    nodes_set_memory_budget(settings.memory_budget, BASE_LOG_PATH);
+
+    if (settings.bootstrap_path != NULL && bootstrap_load_list(&bootstrap_list, settings.bootstrap_path) <= 0) {
+        fprintf(stderr, "No bootstrap nodes loaded from %s; using the built-in list\n", settings.bootstrap_path);
+    }
+
+    if (bootstrap_list.num_nodes == 0) {
+        bootstrap_add_defaults(&bootstrap_list);
+    }
+
+    bootstrap_load_scores(&bootstrap_list, BOOTSTRAP_SCORES_PATH);
+    bootstrap_rank(&bootstrap_list);
+
+    const bool have_scores = bootstrap_scored(&bootstrap_list);
+
+    if (settings.geo_db_path != NULL) {
+        geo_db = geo_db_load(settings.geo_db_path);
+
+        if (geo_db == NULL) {
+            fprintf(stderr, "Failed to load geo database %s\n", settings.geo_db_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (pthread_mutex_init(&threads.lock, NULL) != 0) {
         fprintf(stderr, "pthread mutex failed to init in main()\n");
         exit(EXIT_FAILURE);
@@ -458,6 +1240,10 @@ int main(int argc, char **argv)
 
     signal(SIGINT, catch_SIGINT);
 
+    if (!have_scores) {
+        wait_for_first_probe();
+    }
+
     while (true) {
         LOCK;
         if (FLAG_EXIT) {
@@ -476,10 +1262,10 @@ int main(int argc, char **argv)
         }
     }
 
-    /* Wait for threads to exit cleanly */
+    /* Wait for threads to exit cleanly, including a bootstrap probe that may be saving scores */
     while (true) {
         LOCK;
-        if (threads.num_active == 0) {
+        if (threads.num_active == 0 && !threads.probing) {
             UNLOCK;
             break;
         }
@@ -488,5 +1274,7 @@ int main(int argc, char **argv)
         usleep(10000);
     }
 
+    geo_db_free(geo_db);
+
     return 0;
 }
@@ -0,0 +1,529 @@
+/*  nodes.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include <sodium.h>
+
+#include "nodes.h"
+
+/* Number of slots in each fingerprint hash set segment. Must be a power of 2. */
+#define NODES_FP_SEGMENT_SLOTS 4096
+
+/* A fingerprint segment is split once it holds this many fingerprints */
+#define NODES_FP_SEGMENT_MAX (NODES_FP_SEGMENT_SLOTS / 4 * 3)
+
+/* Upper bound for the number of leading fingerprint bits used to index segments */
+#define NODES_FP_MAX_DEPTH 32
+
+#define NODES_CHUNK_BYTES (NODES_CHUNK_SIZE * sizeof(DHT_Node))
+
+struct Nodes_FP_Segment {
+    uint64_t slots[NODES_FP_SEGMENT_SLOTS];
+    uint32_t count;
+    uint32_t depth;   /* number of leading bits shared by all fingerprints in the segment */
+};
+
+static size_t nodes_mem_budget;
+static size_t nodes_mem_total;
+static char nodes_spill_dir[PATH_MAX] = ".";
+
+void nodes_set_memory_budget(size_t budget, const char *spill_dir)
+{
+    nodes_mem_budget = budget;
+    snprintf(nodes_spill_dir, sizeof(nodes_spill_dir), "%s", spill_dir);
+}
+
+size_t nodes_memory_used(void)
+{
+    return __atomic_load_n(&nodes_mem_total, __ATOMIC_RELAXED);
+}
+
+static void nodes_account(Node_Store *store, size_t added, size_t removed)
+{
+    store->mem_used += added - removed;
+    __atomic_add_fetch(&nodes_mem_total, added - removed, __ATOMIC_RELAXED);
+}
+
+static bool nodes_over_budget(void)
+{
+    return nodes_mem_budget != 0 && nodes_memory_used() > nodes_mem_budget;
+}
+
+void nodes_init(Node_Store *store)
+{
+    memset(store, 0, sizeof(Node_Store));
+    store->spill_fd = -1;
+}
+
+void nodes_free(Node_Store *store)
+{
+    for (uint32_t i = 0; i < store->num_chunks; ++i) {
+        free(store->chunks[i]);
+    }
+
+    free(store->chunks);
+
+    /* A segment is pointed to by a contiguous run of 2^(fp_depth - depth) directory entries */
+    if (store->fp_segments != NULL) {
+        for (uint64_t i = 0; i < (1ULL << store->fp_depth);) {
+            Nodes_FP_Segment *seg = store->fp_segments[i];
+            i += 1ULL << (store->fp_depth - seg->depth);
+            free(seg);
+        }
+    }
+
+    free(store->fp_segments);
+
+    if (store->spill_fd != -1) {
+        close(store->spill_fd);
+    }
+
+    nodes_account(store, 0, store->mem_used);
+    nodes_init(store);
+}
+
+/*
+ * Returns the 64-bit fingerprint of public_key, a SipHash keyed with the store's random key so that
+ * nodes can't pick keys that collide with a given node or that all land in one segment. 0 is reserved
+ * for empty hash set slots.
+ */
+static uint64_t nodes_fingerprint(const Node_Store *store, const uint8_t *public_key)
+{
+    uint8_t hash[crypto_shorthash_BYTES];
+    crypto_shorthash(hash, public_key, NODE_PUBLIC_KEY_SIZE, store->fp_key);
+
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+
+    return h ? h : 1;
+}
+
+/* Returns the leading depth bits of fp. */
+static uint64_t nodes_fp_prefix(uint64_t fp, uint32_t depth)
+{
+    return depth ? fp >> (64 - depth) : 0;
+}
+
+static Nodes_FP_Segment *nodes_fp_segment(const Node_Store *store, uint64_t fp)
+{
+    return store->fp_segments[nodes_fp_prefix(fp, store->fp_depth)];
+}
+
+/* Returns the segment slot holding fp, or the empty slot where it would be inserted. The leading
+ * bits select the segment, so the trailing bits select the slot. */
+static uint32_t nodes_find_slot(const Nodes_FP_Segment *seg, uint64_t fp)
+{
+    uint32_t i = (uint32_t) fp & (NODES_FP_SEGMENT_SLOTS - 1);
+
+    while (seg->slots[i] != 0 && seg->slots[i] != fp) {
+        i = (i + 1) & (NODES_FP_SEGMENT_SLOTS - 1);
+    }
+
+    return i;
+}
+
+static void nodes_fp_insert(Nodes_FP_Segment *seg, uint64_t fp)
+{
+    seg->slots[nodes_find_slot(seg, fp)] = fp;
+    ++seg->count;
+}
+
+bool nodes_contains(const Node_Store *store, const uint8_t *public_key)
+{
+    if (store->fp_segments == NULL) {
+        return false;
+    }
+
+    const uint64_t fp = nodes_fingerprint(store, public_key);
+    const Nodes_FP_Segment *seg = nodes_fp_segment(store, fp);
+
+    return seg->slots[nodes_find_slot(seg, fp)] == fp;
+}
+
+static int nodes_spill_chunk(Node_Store *store);
+
+/* Spills old chunks until we're within the memory budget or there's nothing left to spill. */
+static void nodes_make_room(Node_Store *store)
+{
+    while (nodes_over_budget() && nodes_spill_chunk(store) == 0)
+        ;
+}
+
+/* Allocates an empty fingerprint segment and accounts for it. Returns NULL on allocation failure. */
+static Nodes_FP_Segment *nodes_new_fp_segment(Node_Store *store, uint32_t depth)
+{
+    nodes_make_room(store);
+
+    Nodes_FP_Segment *seg = calloc(1, sizeof(Nodes_FP_Segment));
+
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    seg->depth = depth;
+    nodes_account(store, sizeof(Nodes_FP_Segment), 0);
+
+    return seg;
+}
+
+/* Picks the fingerprint key and creates the segment directory with a single segment. Returns -1 if
+ * libsodium fails to initialize or on allocation failure. */
+static int nodes_init_fingerprints(Node_Store *store)
+{
+    if (sodium_init() == -1) {
+        return -1;
+    }
+
+    randombytes_buf(store->fp_key, sizeof(store->fp_key));
+
+    store->fp_segments = malloc(sizeof(Nodes_FP_Segment *));
+
+    if (store->fp_segments == NULL) {
+        return -1;
+    }
+
+    store->fp_segments[0] = nodes_new_fp_segment(store, 0);
+
+    if (store->fp_segments[0] == NULL) {
+        free(store->fp_segments);
+        store->fp_segments = NULL;
+        return -1;
+    }
+
+    store->fp_depth = 0;
+    nodes_account(store, sizeof(Nodes_FP_Segment *), 0);
+
+    return 0;
+}
+
+/* Doubles the segment directory, which only holds pointers. Returns -1 on failure. */
+static int nodes_grow_fp_directory(Node_Store *store)
+{
+    if (store->fp_depth >= NODES_FP_MAX_DEPTH) {
+        return -1;
+    }
+
+    const uint64_t old_size = 1ULL << store->fp_depth;
+
+    nodes_make_room(store);
+
+    Nodes_FP_Segment **dir = malloc(old_size * 2 * sizeof(Nodes_FP_Segment *));
+
+    if (dir == NULL) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < old_size * 2; ++i) {
+        dir[i] = store->fp_segments[i >> 1];
+    }
+
+    free(store->fp_segments);
+    nodes_account(store, old_size * 2 * sizeof(Nodes_FP_Segment *), old_size * sizeof(Nodes_FP_Segment *));
+
+    store->fp_segments = dir;
+    ++store->fp_depth;
+
+    return 0;
+}
+
+/*
+ * Splits the segment that holds fp in two by the next leading fingerprint bit. Only one new segment
+ * is allocated, so a split never needs more than a segment of extra memory.
+ *
+ * Returns 0 on success.
+ * Returns -1 on allocation failure.
+ */
+static int nodes_split_fp_segment(Node_Store *store, uint64_t fp)
+{
+    Nodes_FP_Segment *seg = nodes_fp_segment(store, fp);
+
+    if (seg->depth == store->fp_depth && nodes_grow_fp_directory(store) != 0) {
+        return -1;
+    }
+
+    Nodes_FP_Segment *upper = nodes_new_fp_segment(store, seg->depth + 1);
+
+    if (upper == NULL) {
+        return -1;
+    }
+
+    /* The directory entries pointing to seg form a run; its upper half now points to the new segment */
+    const uint32_t run_bits = store->fp_depth - seg->depth;
+    const uint64_t run_start = nodes_fp_prefix(fp, seg->depth) << run_bits;
+    const uint64_t half = 1ULL << (run_bits - 1);
+
+    for (uint64_t i = run_start + half; i < run_start + half * 2; ++i) {
+        store->fp_segments[i] = upper;
+    }
+
+    uint64_t slots[NODES_FP_SEGMENT_SLOTS];
+    memcpy(slots, seg->slots, sizeof(slots));
+    memset(seg->slots, 0, sizeof(seg->slots));
+    seg->count = 0;
+    ++seg->depth;
+
+    const uint64_t upper_bit = 1ULL << (64 - seg->depth);
+
+    for (uint32_t i = 0; i < NODES_FP_SEGMENT_SLOTS; ++i) {
+        if (slots[i] != 0) {
+            nodes_fp_insert(slots[i] & upper_bit ? upper : seg, slots[i]);
+        }
+    }
+
+    return 0;
+}
+
+/* Opens an anonymous spill file in the spill directory. Returns -1 on failure. */
+static int nodes_open_spill_file(void)
+{
+    if (mkdir(nodes_spill_dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    char path[sizeof(nodes_spill_dir) + 32];
+    snprintf(path, sizeof(path), "%s/nodes-spill-XXXXXX", nodes_spill_dir);
+
+    const int fd = mkstemp(path);
+
+    if (fd != -1) {
+        unlink(path);
+    }
+
+    return fd;
+}
+
+/*
+ * Writes the oldest resident chunk to the spill file and frees it, if it is entirely below the
+ * cold limit.
+ *
+ * Returns 0 on success.
+ * Returns -1 if there is no chunk that can be spilled or it cannot be written.
+ */
+static int nodes_spill_chunk(Node_Store *store)
+{
+    const uint32_t c = store->num_spilled;
+
+    if (c >= store->num_chunks || (uint64_t) (c + 1) * NODES_CHUNK_SIZE > store->cold_limit) {
+        return -1;
+    }
+
+    if (store->spill_fd == -1) {
+        store->spill_fd = nodes_open_spill_file();
+
+        if (store->spill_fd == -1) {
+            return -1;
+        }
+    }
+
+    const uint8_t *data = (const uint8_t *) store->chunks[c];
+    const off_t offset = (off_t) c * NODES_CHUNK_BYTES;
+    size_t written = 0;
+
+    while (written < NODES_CHUNK_BYTES) {
+        const ssize_t ret = pwrite(store->spill_fd, data + written, NODES_CHUNK_BYTES - written, offset + written);
+
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        written += ret;
+    }
+
+    free(store->chunks[c]);
+    store->chunks[c] = NULL;
+    ++store->num_spilled;
+    nodes_account(store, 0, NODES_CHUNK_BYTES);
+
+    return 0;
+}
+
+/* Adds a new chunk at the end of the store, spilling old chunks first if we're over budget. */
+static int nodes_add_chunk(Node_Store *store)
+{
+    nodes_make_room(store);
+
+    if (store->num_chunks == store->chunks_size) {
+        const uint32_t new_size = store->chunks_size ? store->chunks_size * 2 : 16;
+        DHT_Node **tmp = realloc(store->chunks, new_size * sizeof(DHT_Node *));
+
+        if (tmp == NULL) {
+            return -1;
+        }
+
+        nodes_account(store, (new_size - store->chunks_size) * sizeof(DHT_Node *), 0);
+        store->chunks = tmp;
+        store->chunks_size = new_size;
+    }
+
+    DHT_Node *chunk = malloc(NODES_CHUNK_BYTES);
+
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    store->chunks[store->num_chunks++] = chunk;
+    nodes_account(store, NODES_CHUNK_BYTES, 0);
+
+    return 0;
+}
+
+int nodes_add(Node_Store *store, const DHT_Node *node)
+{
+    if (store->fp_segments == NULL && nodes_init_fingerprints(store) != 0) {
+        return -1;
+    }
+
+    const uint64_t fp = nodes_fingerprint(store, node->public_key);
+    Nodes_FP_Segment *seg = nodes_fp_segment(store, fp);
+
+    if (seg->slots[nodes_find_slot(seg, fp)] == fp) {
+        return 1;
+    }
+
+    while (seg->count >= NODES_FP_SEGMENT_MAX) {
+        if (nodes_split_fp_segment(store, fp) != 0) {
+            return -1;
+        }
+
+        seg = nodes_fp_segment(store, fp);
+    }
+
+    if (store->num_nodes == store->num_chunks * NODES_CHUNK_SIZE && nodes_add_chunk(store) != 0) {
+        return -1;
+    }
+
+    nodes_fp_insert(seg, fp);
+    store->chunks[store->num_nodes / NODES_CHUNK_SIZE][store->num_nodes % NODES_CHUNK_SIZE] = *node;
+    ++store->num_nodes;
+
+    return 0;
+}
+
+const DHT_Node *nodes_get(const Node_Store *store, uint32_t index, DHT_Node *buf)
+{
+    if (index >= store->num_nodes) {
+        return NULL;
+    }
+
+    const DHT_Node *chunk = store->chunks[index / NODES_CHUNK_SIZE];
+
+    if (chunk != NULL) {
+        return &chunk[index % NODES_CHUNK_SIZE];
+    }
+
+    const off_t offset = (off_t) index * sizeof(DHT_Node);
+
+    if (pread(store->spill_fd, buf, sizeof(DHT_Node), offset) != sizeof(DHT_Node)) {
+        return NULL;
+    }
+
+    return buf;
+}
+
+uint32_t nodes_first_resident(const Node_Store *store)
+{
+    return store->num_spilled * NODES_CHUNK_SIZE;
+}
+
+DHT_Node *nodes_get_mutable(Node_Store *store, uint32_t index)
+{
+    if (index >= store->num_nodes) {
+        return NULL;
+    }
+
+    DHT_Node *chunk = store->chunks[index / NODES_CHUNK_SIZE];
+
+    return chunk ? &chunk[index % NODES_CHUNK_SIZE] : NULL;
+}
+
+void nodes_set_cold_limit(Node_Store *store, uint32_t index)
+{
+    store->cold_limit = index;
+}
+
+int node_ip_parse(DHT_Node *node, const char *ip)
+{
+    memset(node->ip, 0, sizeof(node->ip));
+
+    if (inet_pton(AF_INET, ip, node->ip) == 1) {
+        node->family = NODE_IPV4;
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, ip, node->ip) == 1) {
+        node->family = NODE_IPV6;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Writes the decimal representation of n to p and returns a pointer past the last digit. */
+static char *node_put_octet(char *p, uint8_t n)
+{
+    if (n >= 100) {
+        *p++ = '0' + n / 100;
+    }
+
+    if (n >= 10) {
+        *p++ = '0' + n / 10 % 10;
+    }
+
+    *p++ = '0' + n % 10;
+
+    return p;
+}
+
+/* IPv4 addresses are formatted by hand since this is called for every request we send */
+const char *node_ip_string(const DHT_Node *node, char *buf, size_t buf_len)
+{
+    if (node->family == NODE_IPV4 && buf_len >= INET_ADDRSTRLEN) {
+        char *p = buf;
+
+        for (size_t i = 0; i < 4; ++i) {
+            p = node_put_octet(p, node->ip[i]);
+            *p++ = '.';
+        }
+
+        p[-1] = '\0';
+
+        return buf;
+    }
+
+    if (inet_ntop(node->family == NODE_IPV4 ? AF_INET : AF_INET6, node->ip, buf, buf_len) == NULL) {
+        snprintf(buf, buf_len, "-");
+    }
+
+    return buf;
+}
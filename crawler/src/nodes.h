@@ -0,0 +1,142 @@
+/*  nodes.h
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NODES_H
+#define NODES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NODE_PUBLIC_KEY_SIZE 32
+
+/* Size of a buffer large enough to hold any IP address string produced by node_ip_string() */
+#define NODE_IP_STRING_SIZE 48
+
+/* Number of nodes held by each storage chunk */
+#define NODES_CHUNK_SIZE 4096
+
+/* Size of the random key fingerprints are computed with, crypto_shorthash_KEYBYTES */
+#define NODES_FP_KEY_SIZE 16
+
+typedef enum Node_Family {
+    NODE_IPV4,
+    NODE_IPV6,
+} Node_Family;
+
+typedef struct DHT_Node {
+    uint8_t  public_key[NODE_PUBLIC_KEY_SIZE];
+    uint8_t  ip[16];   /* IPv4 addresses use the first 4 bytes */
+    uint8_t  family;   /* Node_Family */
+    uint8_t  verify_state;
+    uint8_t  verify_attempts;
+    uint16_t port;
+} DHT_Node;
+
+/* A fixed size segment of the fingerprint hash set */
+typedef struct Nodes_FP_Segment Nodes_FP_Segment;
+
+/*
+ * An append-only list of unique nodes.
+ *
+ * Nodes are kept in fixed size chunks rather than one contiguous array, so growing the list never
+ * copies it. Duplicates are detected with a hash set of 64-bit public key fingerprints, which is made
+ * of fixed size segments indexed by the leading bits of a fingerprint (extendible hashing). A full
+ * segment is split in two, so the set grows one segment at a time and is never copied as a whole.
+ *
+ * Fingerprints are keyed with a random per-store key, so the keys nodes announce can't be chosen to
+ * collide. Only the fingerprint is compared, so two distinct keys with the same fingerprint count as
+ * one node. For n nodes the chance of any such collision is about n^2 / 2^65: below 3 in a million
+ * for 10 million nodes.
+ * When the process wide memory budget is exceeded, the oldest chunks whose nodes are below the cold
+ * limit are written to an unlinked append-only spill file and freed. Spilled nodes can still be read,
+ * but not modified.
+ */
+typedef struct Node_Store {
+    DHT_Node **chunks;   /* NULL for spilled chunks */
+    uint32_t num_chunks;
+    uint32_t chunks_size;
+    uint32_t num_spilled;   /* chunks [0, num_spilled) are in the spill file */
+    uint32_t num_nodes;
+    uint32_t cold_limit;
+
+    Nodes_FP_Segment **fp_segments;   /* indexed by the leading fp_depth bits of a fingerprint */
+    uint32_t fp_depth;
+    uint8_t  fp_key[NODES_FP_KEY_SIZE];
+
+    int      spill_fd;
+    size_t   mem_used;
+} Node_Store;
+
+/*
+ * Sets the memory budget in bytes shared by all node stores in the process. 0 means unlimited.
+ * Spill files are created in spill_dir.
+ */
+void nodes_set_memory_budget(size_t budget, const char *spill_dir);
+
+/* Returns the number of bytes currently used by all node stores in the process. */
+size_t nodes_memory_used(void);
+
+void nodes_init(Node_Store *store);
+void nodes_free(Node_Store *store);
+
+/* Returns true if a node with public_key is in the store. */
+bool nodes_contains(const Node_Store *store, const uint8_t *public_key);
+
+/*
+ * Appends node to the store unless a node with the same public key is already in it.
+ *
+ * Returns 0 if the node was added.
+ * Returns 1 if the node is already in the store.
+ * Returns -1 on memory allocation failure or if libsodium fails to initialize.
+ */
+int nodes_add(Node_Store *store, const DHT_Node *node);
+
+/*
+ * Returns the node at index. Spilled nodes are read into buf.
+ *
+ * Returns NULL if index is out of range or the node cannot be read from the spill file.
+ */
+const DHT_Node *nodes_get(const Node_Store *store, uint32_t index, DHT_Node *buf);
+
+/* Returns the index of the oldest node that has not been spilled, so that nodes from there on can be
+ * read without touching the spill file. */
+uint32_t nodes_first_resident(const Node_Store *store);
+
+/* Returns the node at index for modification, or NULL if it has been spilled or index is out of range. */
+DHT_Node *nodes_get_mutable(Node_Store *store, uint32_t index);
+
+/* Declares that nodes below index will no longer be modified, which allows them to be spilled. */
+void nodes_set_cold_limit(Node_Store *store, uint32_t index);
+
+/*
+ * Sets the address of node from an IP address string.
+ *
+ * Returns 0 on success.
+ * Returns -1 if ip is not a valid IPv4 or IPv6 address.
+ */
+int node_ip_parse(DHT_Node *node, const char *ip);
+
+/* Puts the IP address string of node in buf and returns buf. */
+const char *node_ip_string(const DHT_Node *node, char *buf, size_t buf_len);
+
+#endif  /* NODES_H */
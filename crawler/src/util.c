@@ -22,10 +22,13 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <string.h>
 #include <time.h>
 #include <sys/stat.h>
 
+#include "util.h"
+
 /* Returns the current unix time. */
 time_t get_time(void)
 {
@@ -60,6 +63,13 @@ int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size
         return -1;
     }
 
+    /* sscanf() would stop at the first non-hex character and leave the rest of the byte as is */
+    for (size_t i = 0; i < hex_len; ++i) {
+        if (!isxdigit((unsigned char) hex_string[i])) {
+            return -1;
+        }
+    }
+
     for (size_t i = 0; i < output_size; ++i) {
         sscanf(hex_string, "%2hhx", &output[i]);
         hex_string += 2;
@@ -77,7 +87,6 @@ int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size
  * Returns 0 on success.
  * Returns -1 on failure.
  */
-#define BASE_LOG_PATH "../crawler_logs"
 int get_log_path(char *buf, size_t buf_len)
 {
     time_t tm = get_time();
@@ -23,6 +23,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+/* Directory that crawler logs are written to, relative to the crawler's working directory */
+#define BASE_LOG_PATH "../crawler_logs"
 
 /* Returns the current unix time. */
 time_t get_time(void);
@@ -38,7 +40,7 @@ void get_time_format(char *buf, int bufsize);
  * output_size must be exactly half of hex_len.
  *
  * Returns 0 on success.
- * Returns -1 on failure.
+ * Returns -1 if the lengths don't match or hex_string holds a character that isn't a hex digit.
  */
 int hex_string_to_bin(const char *hex_string, size_t hex_len, char *output, size_t output_size);
 
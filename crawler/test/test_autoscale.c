@@ -0,0 +1,183 @@
+/*  test_autoscale.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Runs autoscale_decide() over a table of host and crawler signals with the default config, which
+ * has a 60 second warmup, starts crawlers 60 to 180 seconds apart and runs 1 to 4 of them. One more
+ * case feeds samples through autoscale_add_sample() to check that a single quiet interval is smoothed
+ * over.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/autoscale.h"
+
+#define TEST_MAX_CRAWLERS 4
+
+typedef struct Test_Case {
+    const char        *name;
+    Autoscale_Host    host;
+    Autoscale_Crawler crawlers[TEST_MAX_CRAWLERS];
+    uint16_t          num_crawlers;
+    time_t            since_last_start;
+    Autoscale_Action  action;
+    uint32_t          crawler_id;   /* expected crawler to stop */
+} Test_Case;
+
+/* id, age, num_nodes, passes, num_samples, discovery_rate, peak_rate, yield, overlap */
+#define BULK(id)          { id, 300, 5000, 0,  60, 80.0, 100.0, 500.0, 0.0 }
+#define TAIL(id)          { id, 600, 9000, 2, 120,  1.0, 100.0,  50.0, 0.1 }
+#define SUPERSEDED(id)    { id, 900, 9000, 3, 180,  1.0, 100.0,  50.0, 0.95 }
+#define FIRST_PASS(id)    { id, 900, 9000, 0, 180,  1.0, 100.0,   0.1, 0.95 }
+#define UNPRODUCTIVE(id)  { id, 900, 9000, 1, 180,  0.1, 100.0,   0.1, 0.1 }
+#define WARMING_UP(id)    { id,  30,    0, 0,   6,  0.0,   0.0,   0.0, 0.0 }
+#define NEVER_FOUND(id)   { id, 120,    0, 1,  24,  0.0,   0.0,   0.0, 0.0 }
+
+#define IDLE       { 0.1, 0.0 }
+#define CPU_BOUND  { 0.95, 0.0 }
+#define DROPPING   { 0.1, 500.0 }
+
+static const Test_Case test_cases[] = {
+    { "no crawlers",                  IDLE, { {0} }, 0, 0, AUTOSCALE_START, 0 },
+    { "newest in its tail",           IDLE, { TAIL(1) }, 1, 600, AUTOSCALE_START, 0 },
+    { "newest still finding nodes",   IDLE, { BULK(1) }, 1, 120, AUTOSCALE_DELAY, 0 },
+    { "newest getting stale",         IDLE, { BULK(1) }, 1, 180, AUTOSCALE_START, 0 },
+    { "started one recently",         IDLE, { TAIL(1) }, 1, 59, AUTOSCALE_DELAY, 0 },
+    { "no start when CPU bound",      CPU_BOUND, { TAIL(1) }, 1, 600, AUTOSCALE_DELAY, 0 },
+    { "no start when dropping",       DROPPING, { TAIL(1) }, 1, 600, AUTOSCALE_DELAY, 0 },
+    { "at maximum",                   IDLE, { BULK(1), BULK(2), BULK(3), BULK(4) }, 4, 600, AUTOSCALE_DELAY, 0 },
+    { "at maximum with newest tail",  IDLE, { TAIL(1), TAIL(2), TAIL(3), TAIL(4) }, 4, 600, AUTOSCALE_DELAY, 0 },
+    { "stop superseded in tail",      IDLE, { SUPERSEDED(1), BULK(2) }, 2, 120, AUTOSCALE_STOP, 1 },
+    { "stop unproductive in tail",    IDLE, { TAIL(1), UNPRODUCTIVE(2), BULK(3) }, 3, 120, AUTOSCALE_STOP, 2 },
+    { "stop oldest tail when loaded", CPU_BOUND, { BULK(1), TAIL(2), TAIL(3) }, 3, 120, AUTOSCALE_STOP, 2 },
+    { "keep crawler in first pass",   CPU_BOUND, { FIRST_PASS(1), BULK(2) }, 2, 120, AUTOSCALE_DELAY, 0 },
+    { "keep healthy tail",            IDLE, { TAIL(1), BULK(2) }, 2, 120, AUTOSCALE_DELAY, 0 },
+    { "keep bulk when loaded",        DROPPING, { BULK(1), BULK(2) }, 2, 600, AUTOSCALE_DELAY, 0 },
+    { "keep the minimum",             IDLE, { SUPERSEDED(1) }, 1, 30, AUTOSCALE_DELAY, 0 },
+    { "stop past maximum",            IDLE, { SUPERSEDED(1), BULK(2), BULK(3), BULK(4) }, 4, 600, AUTOSCALE_STOP, 1 },
+    { "peak 0 in warmup is kept",     IDLE, { WARMING_UP(1), WARMING_UP(2) }, 2, 30, AUTOSCALE_DELAY, 0 },
+    { "peak 0 past warmup is stopped", IDLE, { NEVER_FOUND(1), BULK(2) }, 2, 120, AUTOSCALE_STOP, 1 },
+    { "peak 0 newest is in its tail", IDLE, { NEVER_FOUND(1) }, 1, 120, AUTOSCALE_START, 0 },
+};
+
+static const char *test_action_name(Autoscale_Action action)
+{
+    switch (action) {
+        case AUTOSCALE_NONE:
+            return "none";
+
+        case AUTOSCALE_START:
+            return "start";
+
+        case AUTOSCALE_DELAY:
+            return "delay";
+
+        case AUTOSCALE_STOP:
+            return "stop";
+    }
+
+    return "unknown";
+}
+
+/* Seconds between two samples, as taken by the supervisor */
+#define TEST_SAMPLE_INTERVAL 5
+
+/*
+ * Feeds a crawler 50 nodes per second for 85 seconds, then one interval with no new nodes, and checks
+ * that it is kept next to a newer crawler. It has made a full pass, so only the smoothing keeps it.
+ *
+ * Returns the number of failed checks.
+ */
+static uint32_t test_empty_sample(const Autoscale_Config *config)
+{
+    const Autoscale_Host host = IDLE;
+    Autoscale_Crawler crawlers[2] = { { 0 }, BULK(2) };
+    Autoscale_Crawler *crawler = &crawlers[0];
+
+    crawler->id = 1;
+    crawler->passes = 1;
+
+    for (uint32_t i = 0; i < 17; ++i) {
+        autoscale_add_sample(crawler, 50 * TEST_SAMPLE_INTERVAL, TEST_SAMPLE_INTERVAL, 0.5);
+    }
+
+    autoscale_add_sample(crawler, 0, TEST_SAMPLE_INTERVAL, 0.5);
+    crawler->age = 90;
+    crawler->num_nodes = 4250;
+
+    const Autoscale_Decision d = autoscale_decide(config, &host, crawlers, 2, 120);
+
+    if (d.action == AUTOSCALE_STOP) {
+        fprintf(stderr, "autoscale: one empty sample mid-crawl: stopped crawler %u (%s)\n", d.crawler_id, d.reason);
+        return 1;
+    }
+
+    /* Once it keeps finding nothing it does reach its tail and gets stopped for its yield */
+    for (uint32_t i = 0; i < 40; ++i) {
+        autoscale_add_sample(crawler, 0, TEST_SAMPLE_INTERVAL, 0.5);
+    }
+
+    crawler->age += 40 * TEST_SAMPLE_INTERVAL;
+
+    const Autoscale_Decision later = autoscale_decide(config, &host, crawlers, 2, 120);
+
+    if (later.action != AUTOSCALE_STOP || later.crawler_id != 1) {
+        fprintf(stderr, "autoscale: crawler that stopped finding nodes: expected stop 1, got %s %u\n",
+                test_action_name(later.action), later.crawler_id);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    Autoscale_Config config;
+    autoscale_default_config(&config);
+
+    const size_t num_cases = sizeof(test_cases) / sizeof(test_cases[0]);
+    uint32_t errors = 0;
+
+    for (size_t i = 0; i < num_cases; ++i) {
+        const Test_Case *t = &test_cases[i];
+        const Autoscale_Decision d = autoscale_decide(&config, &t->host, t->crawlers, t->num_crawlers,
+                                                      t->since_last_start);
+
+        if (d.action != t->action || (t->action == AUTOSCALE_STOP && d.crawler_id != t->crawler_id)) {
+            fprintf(stderr, "autoscale: %s: expected %s %u, got %s %u (%s)\n", t->name, test_action_name(t->action),
+                    t->crawler_id, test_action_name(d.action), d.crawler_id, d.reason ? d.reason : "no reason");
+            ++errors;
+        }
+    }
+
+    errors += test_empty_sample(&config);
+
+    if (errors != 0) {
+        fprintf(stderr, "autoscale: %u of %zu cases failed\n", errors, num_cases + 1);
+        return EXIT_FAILURE;
+    }
+
+    printf("autoscale: %zu cases OK\n", num_cases + 1);
+
+    return EXIT_SUCCESS;
+}
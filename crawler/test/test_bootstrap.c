@@ -0,0 +1,229 @@
+/*  test_bootstrap.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Checks that bootstrap_rank() puts healthy candidates first, fastest first, then untested ones in
+ * the order they were listed, then failing ones with the fewest consecutive failures first. Every
+ * ordering of the input in a set of rotations and reversals has to give the same ranking. Also checks
+ * that a candidates file with malformed keys only yields its valid lines.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/bootstrap.h"
+
+typedef struct Test_Candidate {
+    const char *name;
+    double     rtt_ms;
+    uint32_t   successes;
+    uint32_t   failures;
+} Test_Candidate;
+
+/* In the expected order. Failing candidates that answered before keep their old round trip time. */
+static const Test_Candidate test_candidates[] = {
+    { "live 8ms",        8.0, 3, 0 },
+    { "live 20ms",      20.0, 1, 0 },
+    { "live 95ms",      95.0, 9, 0 },
+    { "live 310ms",    310.0, 2, 0 },
+    { "untested a",      0.0, 0, 0 },
+    { "untested b",      0.0, 0, 0 },
+    { "untested c",      0.0, 0, 0 },
+    { "flaky 1 fail",   12.0, 5, 1 },
+    { "dead 1 fail",     0.0, 0, 1 },
+    { "flaky 2 fails",   7.0, 4, 2 },
+    { "dead 5 fails",    0.0, 0, 5 },
+};
+
+#define TEST_NUM_CANDIDATES (sizeof(test_candidates) / sizeof(test_candidates[0]))
+
+/* Adds candidate i to list, with a public key that identifies it. */
+static void test_add(Bootstrap_List *list, uint16_t i)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char key[NODE_PUBLIC_KEY_SIZE * 2 + 1];
+
+    memset(key, '0', sizeof(key) - 1);
+    key[0] = hex[i >> 4];
+    key[1] = hex[i & 0xF];
+    key[sizeof(key) - 1] = '\0';
+
+    if (bootstrap_add(list, "127.0.0.1", 33445 + i, key) != 0) {
+        fprintf(stderr, "bootstrap: bootstrap_add() failed for %s\n", test_candidates[i].name);
+        exit(EXIT_FAILURE);
+    }
+
+    Bootstrap_Node *bs = &list->nodes[list->num_nodes - 1];
+    bs->rtt_ms = test_candidates[i].rtt_ms;
+    bs->successes = test_candidates[i].successes;
+    bs->failures = test_candidates[i].failures;
+}
+
+/*
+ * Ranks the candidates listed in rotated order, reversed or not. Untested candidates are always listed
+ * in their expected relative order, since ranking keeps the order they were listed in.
+ *
+ * Returns the number of candidates out of place.
+ */
+static uint32_t test_rank(uint16_t rotation, bool reverse)
+{
+    Bootstrap_List *list = calloc(1, sizeof(Bootstrap_List));
+
+    if (list == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t order[TEST_NUM_CANDIDATES];
+
+    for (uint16_t i = 0; i < TEST_NUM_CANDIDATES; ++i) {
+        const uint16_t pos = reverse ? TEST_NUM_CANDIDATES - 1 - i : i;
+        order[(pos + rotation) % TEST_NUM_CANDIDATES] = i;
+    }
+
+    /* Put the untested candidates back in their listed order */
+    uint16_t next_untested = 0;
+
+    for (uint16_t i = 0; i < TEST_NUM_CANDIDATES; ++i) {
+        const Test_Candidate *c = &test_candidates[order[i]];
+
+        if (c->successes == 0 && c->failures == 0) {
+            while (test_candidates[next_untested].successes != 0 || test_candidates[next_untested].failures != 0) {
+                ++next_untested;
+            }
+
+            order[i] = next_untested++;
+        }
+    }
+
+    for (uint16_t i = 0; i < TEST_NUM_CANDIDATES; ++i) {
+        test_add(list, order[i]);
+    }
+
+    bootstrap_rank(list);
+
+    uint32_t errors = 0;
+
+    for (uint16_t i = 0; i < TEST_NUM_CANDIDATES; ++i) {
+        const uint16_t id = list->nodes[i].node.port - 33445;
+
+        if (id != i) {
+            fprintf(stderr, "bootstrap: rotation %u%s: expected \"%s\" at %u, got \"%s\"\n", rotation,
+                    reverse ? " reversed" : "", test_candidates[i].name, i, test_candidates[id].name);
+            ++errors;
+        }
+    }
+
+    for (uint16_t i = 0; i < TEST_NUM_CANDIDATES; ++i) {
+        const bool healthy = test_candidates[i].successes > 0 && test_candidates[i].failures == 0;
+        const uint16_t id = list->nodes[i].node.port - 33445;
+
+        if (id == i && bootstrap_healthy(&list->nodes[i]) != healthy) {
+            fprintf(stderr, "bootstrap: wrong health for \"%s\"\n", test_candidates[i].name);
+            ++errors;
+        }
+    }
+
+    free(list);
+
+    return errors;
+}
+
+#define TEST_VALID_KEY "7E5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD34C"
+
+/* Lines of a candidates file; only the first one is valid */
+static const char *const test_list_lines[] = {
+    "127.0.0.1 33445 " TEST_VALID_KEY,
+    "127.0.0.1 33446 7E5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD3ZZ",
+    "127.0.0.1 33447 0x5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD34C",
+    "127.0.0.1 33448 7E5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD3 C",
+    "127.0.0.1 33449 7E5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD3",
+    "127.0.0.1 0 " TEST_VALID_KEY,
+    "not-an-ip 33450 " TEST_VALID_KEY,
+};
+
+/* Returns the number of failed checks. */
+static uint32_t test_load_list(void)
+{
+    char path[] = "/tmp/test_bootstrap_XXXXXX";
+    const int fd = mkstemp(path);
+    FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    if (fp == NULL) {
+        fprintf(stderr, "bootstrap: failed to create a candidates file\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(test_list_lines) / sizeof(test_list_lines[0]); ++i) {
+        fprintf(fp, "%s\n", test_list_lines[i]);
+    }
+
+    fclose(fp);
+
+    Bootstrap_List *list = calloc(1, sizeof(Bootstrap_List));
+    uint32_t errors = 0;
+
+    if (list == NULL) {
+        unlink(path);
+        return 1;
+    }
+
+    /* Prints a warning for each invalid line */
+    const int count = bootstrap_load_list(list, path);
+
+    if (count != 1 || list->num_nodes != 1 || list->nodes[0].node.port != 33445) {
+        fprintf(stderr, "bootstrap: expected only the first candidate to load, got %d\n", count);
+        ++errors;
+    }
+
+    if (bootstrap_add(list, "127.0.0.1", 33445,
+                      "7E5668E0EE09E19F320AD47902419331FFEE147BB3606769CFBE921A2A2FD3g4") != -1) {
+        fprintf(stderr, "bootstrap: bootstrap_add() accepted a key with a non-hex character\n");
+        ++errors;
+    }
+
+    free(list);
+    unlink(path);
+
+    return errors;
+}
+
+int main(void)
+{
+    uint32_t errors = test_load_list();
+
+    for (uint16_t rotation = 0; rotation < TEST_NUM_CANDIDATES; ++rotation) {
+        errors += test_rank(rotation, false);
+        errors += test_rank(rotation, true);
+    }
+
+    if (errors != 0) {
+        fprintf(stderr, "bootstrap: %u checks failed\n", errors);
+        return EXIT_FAILURE;
+    }
+
+    printf("bootstrap: %zu candidates ranked OK in %zu orders\n", TEST_NUM_CANDIDATES, TEST_NUM_CANDIDATES * 2);
+
+    return EXIT_SUCCESS;
+}
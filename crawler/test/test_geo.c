@@ -0,0 +1,321 @@
+/*  test_geo.c
+ *
+ *
+ *  Copyright (C) 2016 toxcrawler All Rights Reserved.
+ *
+ *  This file is part of toxcrawler.
+ *
+ *  toxcrawler is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  toxcrawler is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with toxcrawler.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Checks poptrie lookups against a linear scan over the ranges the database was compiled from.
+ *
+ * A random text database of adjacent and separated IPv4 and IPv6 ranges is compiled and loaded, and
+ * every range boundary, the addresses just outside of it and a set of random addresses are looked up.
+ * IPv4 addresses are also looked up in their IPv4-mapped IPv6 form.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../src/geo.h"
+
+#define TEST_IPV4_RANGES 2000
+#define TEST_IPV6_RANGES 2000
+#define TEST_RANDOM_LOOKUPS 20000
+
+/* One in this many ranges has an ASN of 0, which the compiler ignores */
+#define TEST_IGNORED_RANGE_RATIO 10
+
+typedef unsigned __int128 test_addr;
+
+typedef struct Test_Range {
+    test_addr start;
+    test_addr end;
+    uint32_t  asn;
+    char      country[3];
+} Test_Range;
+
+typedef struct Test_Ranges {
+    Test_Range ipv4[TEST_IPV4_RANGES];
+    Test_Range ipv6[TEST_IPV6_RANGES];
+    uint32_t   num_ipv4;
+    uint32_t   num_ipv6;
+} Test_Ranges;
+
+static uint64_t test_rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t test_rand(void)
+{
+    uint64_t x = test_rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    test_rng_state = x;
+    return x;
+}
+
+static test_addr test_rand_addr(void)
+{
+    return (test_addr) test_rand() << 64 | test_rand();
+}
+
+static void test_addr_string(test_addr addr, bool ipv6, char *buf, size_t buf_len)
+{
+    if (!ipv6) {
+        const uint32_t a = htonl((uint32_t) addr);
+        inet_ntop(AF_INET, &a, buf, buf_len);
+        return;
+    }
+
+    uint8_t bytes[16];
+
+    for (int i = 15; i >= 0; --i) {
+        bytes[i] = (uint8_t) addr;
+        addr >>= 8;
+    }
+
+    inet_ntop(AF_INET6, bytes, buf, buf_len);
+}
+
+static void test_rand_record(Test_Range *range)
+{
+    const uint64_t r = test_rand();
+    range->asn = r % TEST_IGNORED_RANGE_RATIO == 0 ? 0 : (uint32_t) (r >> 8) % 400000 + 1;
+    range->country[0] = 'A' + (r >> 40) % 26;
+    range->country[1] = 'A' + (r >> 48) % 26;
+    range->country[2] = '\0';
+}
+
+/*
+ * Fills ranges with num ascending ranges in [0, max]. About a third of the ranges start right after
+ * the previous one. The first range starts at 0 and the last one ends at max, so the edges of the
+ * address space are covered too.
+ */
+static uint32_t test_make_ranges(Test_Range *ranges, uint32_t num, test_addr max, uint32_t span_bits)
+{
+    const test_addr step = max / num;
+    test_addr next = 0;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < num && next <= max - step; ++i) {
+        Test_Range *range = &ranges[count++];
+        const test_addr gap = test_rand() % 3 == 0 ? 0 : test_rand_addr() % (step / 2);
+
+        range->start = i == 0 ? 0 : next + gap;
+
+        const uint32_t bits = test_rand() % span_bits;
+        const test_addr len = test_rand_addr() & (((test_addr) 1 << bits) - 1);
+        range->end = i == num - 1 || range->start + len > max - step ? max : range->start + len;
+
+        test_rand_record(range);
+        next = range->end + 1;
+
+        if (range->end == max) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+static int test_write_ranges(const Test_Ranges *ranges, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char start[INET6_ADDRSTRLEN];
+    char end[INET6_ADDRSTRLEN];
+
+    for (uint32_t i = 0; i < ranges->num_ipv4; ++i) {
+        const Test_Range *r = &ranges->ipv4[i];
+        test_addr_string(r->start, false, start, sizeof(start));
+        test_addr_string(r->end, false, end, sizeof(end));
+        fprintf(fp, "%s\t%s\t%u\t%s\tTest\n", start, end, r->asn, r->country);
+    }
+
+    for (uint32_t i = 0; i < ranges->num_ipv6; ++i) {
+        const Test_Range *r = &ranges->ipv6[i];
+        test_addr_string(r->start, true, start, sizeof(start));
+        test_addr_string(r->end, true, end, sizeof(end));
+        fprintf(fp, "%s\t%s\t%u\t%s\tTest\n", start, end, r->asn, r->country);
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Returns the range covering addr that the database should know about, or NULL. */
+static const Test_Range *test_scan(const Test_Range *ranges, uint32_t num, test_addr addr)
+{
+    for (uint32_t i = 0; i < num; ++i) {
+        if (addr >= ranges[i].start && addr <= ranges[i].end) {
+            return ranges[i].asn != 0 ? &ranges[i] : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static bool test_record_matches(const Geo_DB *db, uint32_t id, const Test_Range *expected)
+{
+    const Geo_Record *rec = geo_get_record(db, id);
+
+    if (expected == NULL) {
+        return rec == NULL;
+    }
+
+    return rec != NULL && rec->asn == expected->asn && memcmp(rec->country, expected->country, 2) == 0;
+}
+
+/* Returns the number of mismatches for addr. */
+static uint32_t test_check(const Geo_DB *db, const Test_Ranges *ranges, test_addr addr, bool ipv6)
+{
+    char ip[INET6_ADDRSTRLEN];
+    test_addr_string(addr, ipv6, ip, sizeof(ip));
+
+    const Test_Range *expected = ipv6 ? test_scan(ranges->ipv6, ranges->num_ipv6, addr)
+                                 : test_scan(ranges->ipv4, ranges->num_ipv4, addr);
+    uint32_t errors = 0;
+
+    if (!test_record_matches(db, geo_lookup(db, ip), expected)) {
+        fprintf(stderr, "geo: wrong record for %s\n", ip);
+        ++errors;
+    }
+
+    if (ipv6) {
+        return errors;
+    }
+
+    if (!test_record_matches(db, geo_lookup_ipv4(db, (uint32_t) addr), expected)) {
+        fprintf(stderr, "geo: wrong record for %s through geo_lookup_ipv4()\n", ip);
+        ++errors;
+    }
+
+    char mapped[INET6_ADDRSTRLEN + 8];
+    snprintf(mapped, sizeof(mapped), "::ffff:%s", ip);
+
+    if (!test_record_matches(db, geo_lookup(db, mapped), expected)) {
+        fprintf(stderr, "geo: wrong record for %s\n", mapped);
+        ++errors;
+    }
+
+    return errors;
+}
+
+static uint32_t test_check_boundaries(const Geo_DB *db, const Test_Ranges *ranges, const Test_Range *list,
+                                      uint32_t num, test_addr max, bool ipv6)
+{
+    uint32_t errors = 0;
+
+    for (uint32_t i = 0; i < num; ++i) {
+        const Test_Range *r = &list[i];
+
+        errors += test_check(db, ranges, r->start, ipv6);
+        errors += test_check(db, ranges, r->end, ipv6);
+        errors += test_check(db, ranges, r->start + (r->end - r->start) / 2, ipv6);
+
+        if (r->start > 0) {
+            errors += test_check(db, ranges, r->start - 1, ipv6);
+        }
+
+        if (r->end < max) {
+            errors += test_check(db, ranges, r->end + 1, ipv6);
+        }
+    }
+
+    return errors;
+}
+
+int main(void)
+{
+    const test_addr ipv4_max = UINT32_MAX;
+    const test_addr ipv6_max = ~(test_addr) 0;
+
+    Test_Ranges *ranges = calloc(1, sizeof(Test_Ranges));
+
+    if (ranges == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    ranges->num_ipv4 = test_make_ranges(ranges->ipv4, TEST_IPV4_RANGES, ipv4_max, 24);
+    ranges->num_ipv6 = test_make_ranges(ranges->ipv6, TEST_IPV6_RANGES, ipv6_max, 112);
+
+    char text_path[] = "/tmp/test_geo_XXXXXX";
+    const int fd = mkstemp(text_path);
+
+    if (fd == -1) {
+        free(ranges);
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+
+    char db_path[sizeof(text_path) + 3];
+    snprintf(db_path, sizeof(db_path), "%s.db", text_path);
+
+    int ret = EXIT_FAILURE;
+    Geo_DB *db = NULL;
+
+    if (test_write_ranges(ranges, text_path) != 0) {
+        fprintf(stderr, "geo: failed to write %s\n", text_path);
+        goto out;
+    }
+
+    const int err = geo_db_compile(text_path, db_path);
+
+    if (err != 0) {
+        fprintf(stderr, "geo: geo_db_compile() failed with error %d\n", err);
+        goto out;
+    }
+
+    db = geo_db_load(db_path);
+
+    if (db == NULL) {
+        fprintf(stderr, "geo: geo_db_load() failed\n");
+        goto out;
+    }
+
+    uint32_t errors = test_check_boundaries(db, ranges, ranges->ipv4, ranges->num_ipv4, ipv4_max, false);
+    errors += test_check_boundaries(db, ranges, ranges->ipv6, ranges->num_ipv6, ipv6_max, true);
+
+    for (uint32_t i = 0; i < TEST_RANDOM_LOOKUPS; ++i) {
+        errors += test_check(db, ranges, (uint32_t) test_rand(), false);
+        errors += test_check(db, ranges, test_rand_addr(), true);
+    }
+
+    if (errors != 0) {
+        fprintf(stderr, "geo: %u lookups failed\n", errors);
+        goto out;
+    }
+
+    printf("geo: %u IPv4 and %u IPv6 ranges OK\n", ranges->num_ipv4, ranges->num_ipv6);
+    ret = EXIT_SUCCESS;
+
+out:
+    geo_db_free(db);
+    unlink(text_path);
+    unlink(db_path);
+    free(ranges);
+
+    return ret;
+}